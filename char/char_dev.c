@@ -5,7 +5,10 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
+#include <linux/string.h>
+#include <linux/unaligned.h>
 #include <asm/uaccess.h>
 
 
@@ -29,6 +32,41 @@ static ssize_t device_write(struct file*, const char __user*, size_t, loff_t*);
 #define DEVICE_NAME "chardev" // Device name as it appears in /proc/devices.
 #define BUF_LEN 80 // Max length of the message FROM the device.
 
+// What gets reversed: raw bytes, UTF-8 code points or grapheme clusters.
+#define UTF8_BYTES 0
+#define UTF8_CODEPOINTS 1
+#define UTF8_GRAPHEMES 2
+
+static int utf8_mode = UTF8_BYTES;
+
+// Only accept the modes above, anything else would silently mean code points.
+static int utf8_mode_set(const char* val, const struct kernel_param* kp)
+{
+	int mode;
+	int err;
+
+	err = kstrtoint(val, 0, &mode);
+	if (err)
+	{
+		return err;
+	}
+
+	if (mode < UTF8_BYTES || mode > UTF8_GRAPHEMES)
+	{
+		return -EINVAL;
+	}
+
+	return param_set_int(val, kp);
+}
+
+static const struct kernel_param_ops utf8_mode_ops = {
+	.set = utf8_mode_set,
+	.get = param_get_int
+};
+
+module_param_cb(utf8_mode, &utf8_mode_ops, &utf8_mode, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(utf8_mode, "Reverse 0: bytes (default), 1: UTF-8 code points, 2: grapheme clusters");
+
 // Global variables are declared as static so they are global within the FILE.
 
 static int Major;		// Major number assigned to our device driver.
@@ -39,6 +77,9 @@ static char msg_write[BUF_LEN]; // The message the device will return when writi
 static char* msg_read_Ptr;
 static char* msg_write_Ptr;
 
+// The mode of the current opener, taken from utf8_mode at open time.
+static int Utf8_Mode;
+
 static struct file_operations fops = {
 	.read = device_read,
 	.write = device_write,
@@ -100,6 +141,9 @@ static int device_open(struct inode* inode, struct file* filp)
 	msg_read_Ptr = msg_read;
 	msg_write_Ptr = msg_write;
 
+	// Only one process can have us open, so this is a per-fd setting.
+	Utf8_Mode = READ_ONCE(utf8_mode);
+
 	try_module_get(THIS_MODULE);
 
 	return SUCCESS;
@@ -169,17 +213,170 @@ static ssize_t device_read(struct file* filp,	/* see include/linux/fs.h */
 }
 
 
+/*
+ * Length of the well-formed UTF-8 sequence at s, or 0 if there is none.
+ * The decoded code point is stored in cp.
+ */
+static int utf8_seq_len(const unsigned char* s, int left, unsigned int* cp)
+{
+	int len;
+	int i;
+	unsigned int c = s[0];
+
+	if (c < 0x80)
+	{
+		*cp = c;
+		return 1;
+	}
+	else if (c >= 0xc2 && c <= 0xdf)
+	{
+		len = 2;
+		c &= 0x1f;
+	}
+	else if (c >= 0xe0 && c <= 0xef)
+	{
+		len = 3;
+		c &= 0x0f;
+	}
+	else if (c >= 0xf0 && c <= 0xf4)
+	{
+		len = 4;
+		c &= 0x07;
+	}
+	else
+	{
+		return 0;
+	}
+
+	if (left < len)
+	{
+		return 0;
+	}
+
+	for (i = 1; i < len; i++)
+	{
+		if ((s[i] & 0xc0) != 0x80)
+		{
+			return 0;
+		}
+		c = (c << 6) | (s[i] & 0x3f);
+	}
+
+	// No overlong forms, no surrogates, nothing above U+10FFFF.
+	if ((len == 3 && (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))) ||
+	    (len == 4 && (c < 0x10000 || c > 0x10ffff)))
+	{
+		return 0;
+	}
+
+	*cp = c;
+	return len;
+}
+
+// Combining marks, joiners, variation selectors and emoji modifiers
+// belong to the character in front of them.
+static int utf8_is_extend(unsigned int cp)
+{
+	return (cp >= 0x0300 && cp <= 0x036f) ||
+		(cp >= 0x1ab0 && cp <= 0x1aff) ||
+		(cp >= 0x1dc0 && cp <= 0x1dff) ||
+		(cp >= 0x200c && cp <= 0x200d) ||
+		(cp >= 0x20d0 && cp <= 0x20ff) ||
+		(cp >= 0xfe00 && cp <= 0xfe0f) ||
+		(cp >= 0xfe20 && cp <= 0xfe2f) ||
+		(cp >= 0x1f3fb && cp <= 0x1f3ff) ||
+		(cp >= 0xe0100 && cp <= 0xe01ef);
+}
+
+/*
+ * Length of the unit starting at s that has to stay in one piece.
+ * Malformed bytes are units of their own, so nothing is ever lost.
+ */
+static int unit_len(const char* s, int left, int mode)
+{
+	const unsigned char* u = (const unsigned char*)s;
+	unsigned int cp;
+	int len;
+	int n;
+	int zwj;
+
+	if (mode == UTF8_BYTES || u[0] < 0x80)
+	{
+		len = 1;
+	}
+	else
+	{
+		len = utf8_seq_len(u, left, &cp);
+		if (len == 0)
+		{
+			return 1;
+		}
+	}
+
+	if (mode != UTF8_GRAPHEMES)
+	{
+		return len;
+	}
+
+	// Swallow whatever extends this cluster; a joiner glues the next one on.
+	zwj = 0;
+	while (len < left)
+	{
+		n = utf8_seq_len(u + len, left - len, &cp);
+		if (n == 0 || !(zwj || utf8_is_extend(cp)))
+		{
+			break;
+		}
+		zwj = (cp == 0x200d);
+		len += n;
+	}
+
+	return len;
+}
+
+/*
+ * Write the len bytes of src into dst in reverse unit order.
+ * Blocks of 8 pure ASCII bytes are reversed straight away, only the
+ * non-ASCII spans pay for decoding.
+ */
+static void reverse_text(char* dst, const char* src, int len, int mode)
+{
+	int pos = 0;
+	int n;
+
+	while (pos < len)
+	{
+		if (len - pos >= 8 &&
+		    !(get_unaligned((const u64*)(src + pos)) & 0x8080808080808080ULL) &&
+		    (mode != UTF8_GRAPHEMES || len - pos == 8 || !(src[pos + 8] & 0x80)))
+		{
+			for (n = 0; n < 8; n++)
+			{
+				dst[len - 1 - pos - n] = src[pos + n];
+			}
+			pos += 8;
+			continue;
+		}
+
+		n = unit_len(src + pos, len - pos, mode);
+		memcpy(dst + len - pos - n, src + pos, n);
+		pos += n;
+	}
+}
+
+
 // Called when a process writes to dev file: echo "hi" > /dev/hello
 static ssize_t
 device_write(struct file* filp, const char __user*  buff, size_t len, loff_t* off)
 {
 	int i;
-       	int j;	
+	int text_len;
 	int bytes_written = 0;
 	//printk(KERN_INFO "device_write(%p, %s)\n", filp, buff);
 	
 	// Get message from user data segment.
-	for(i = 0; i < len && i < BUF_LEN; i++)
+	// Keep the last byte for the terminating '\0'.
+	for(i = 0; i < len && i < BUF_LEN - 1; i++)
 	{
 		// Fill the buffer from the user data segment.
 		// copy from the pointer buff to msg.
@@ -187,38 +384,26 @@ device_write(struct file* filp, const char __user*  buff, size_t len, loff_t* of
 	}
 	
 	bytes_written = i;
-	i -= 2; // Take out the "\n\0".
-	
-	// msg_write now contains the buffer.
-	// We can reverse it if we want.
-	for(j = 0; j <= bytes_written && j < BUF_LEN && i >= 0; j++)
+	msg_write[bytes_written] = '\0';
+
+	// Take out the "\n" echo adds, it stays at the end.
+	text_len = bytes_written;
+	if (text_len > 0 && msg_write[text_len - 1] == '\n')
 	{
-		// Problem may be the finishing 0.
-		if(msg_write[i] == '\0' || msg_write[i] == '\n')
-		{
-			printk(KERN_INFO "Should not happen.\n");
-			msg_read[j] = '0';
-			i--;
-		}
-		else
-		{
-			msg_read[j] = msg_write[i--];
-		}
-		//printk(KERN_INFO "msg_read[%d]=%c\n",j,msg_read[j]);
-		// This confirms that the array is filled.
+		text_len--;
 	}
+	
+	// msg_write now contains the buffer.
+	// Reverse it by bytes, code points or grapheme clusters so that
+	// multibyte UTF-8 characters come out intact.
+	reverse_text(msg_read, msg_write, text_len, Utf8_Mode);
 
-	// Add the /n and /0
-	msg_read[++j] = msg_write[bytes_written-1];	//'\n';
-	msg_read[++j] = msg_write[bytes_written];	//'\0';
+	// Add the \n and \0
+	memcpy(msg_read + text_len, msg_write + text_len, bytes_written - text_len + 1);
 
 	printk(KERN_INFO "device_write, msg_read = %s, msg_write = %s\n", msg_read, msg_write);
 	printk(KERN_INFO "bytes_written : %d\n", bytes_written);
 	
-	// This is the part where everything goes to hell.
-	// Doesn't show anything in console.
-	//sprintf(msg, msg_write);
-
 	// This is a bit weird. Should have already been done.
 	msg_read_Ptr = msg_read;
 	msg_write_Ptr = msg_write;
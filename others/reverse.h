@@ -0,0 +1,320 @@
+/*
+ * reverse.h - The header file with the ioctl definitions for /dev/reverse.
+ *
+ * The declarations here have to be in a header file, because they need
+ * to be known both by the reverse kernel module and by the processes
+ * talking to the device.
+ */
+
+#ifndef REVERSE_H
+#define REVERSE_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// The ioctl type shared by all the commands below.
+#define REVERSE_IOC_MAGIC 0xB7
+
+/*
+ * Word delimiters, one bit per byte value: byte c is a delimiter if
+ * bit (c % 64) of map[c / 64] is set. The default set is a single space.
+ */
+struct reverse_delims {
+	__u64 map[4];
+};
+
+// Set the word delimiters of this fd.
+#define REVERSE_IOC_SET_DELIMS _IOW(REVERSE_IOC_MAGIC, 0, struct reverse_delims)
+
+// Get the word delimiters of this fd.
+#define REVERSE_IOC_GET_DELIMS _IOR(REVERSE_IOC_MAGIC, 1, struct reverse_delims)
+
+/*
+ * UTF-8 modes. Reversing the word order never reorders the bytes of a word,
+ * so code points survive as long as the input is valid UTF-8 and only ASCII
+ * bytes are used as delimiters; REVERSE_UTF8_CODEPOINT enforces both.
+ * REVERSE_UTF8_GRAPHEME additionally keeps a delimiter followed by
+ * combining marks in one piece instead of splitting the cluster.
+ */
+#define REVERSE_UTF8_NONE	0
+#define REVERSE_UTF8_CODEPOINT	1
+#define REVERSE_UTF8_GRAPHEME	2
+
+// Set the UTF-8 mode of this fd.
+#define REVERSE_IOC_SET_UTF8 _IOW(REVERSE_IOC_MAGIC, 2, __u32)
+
+// Get the UTF-8 mode of this fd.
+#define REVERSE_IOC_GET_UTF8 _IOR(REVERSE_IOC_MAGIC, 3, __u32)
+
+/*
+ * Framing modes. By default every write is one phrase. With framing, a
+ * write may carry any number of records, each reversed on its own and
+ * returned in the same framing:
+ *
+ * REVERSE_FRAME_NEWLINE - records end with a '\n'.
+ * REVERSE_FRAME_LENGTH - records start with their length as a __u32 in
+ *                        host byte order.
+ *
+ * An incomplete last record is kept and completed by the next write. A
+ * record that can never fit in the buffer, newline included, fails the
+ * write with -EMSGSIZE and is dropped. REVERSE_FRAME_LENGTH needs a buffer
+ * of at least 4 bytes: SET_FRAMING and SET_SIZE fail with EINVAL below.
+ */
+#define REVERSE_FRAME_NONE	0
+#define REVERSE_FRAME_NEWLINE	1
+#define REVERSE_FRAME_LENGTH	2
+
+// Set the framing mode of this fd, dropping any incomplete record.
+#define REVERSE_IOC_SET_FRAMING _IOW(REVERSE_IOC_MAGIC, 4, __u32)
+
+// Get the framing mode of this fd.
+#define REVERSE_IOC_GET_FRAMING _IOR(REVERSE_IOC_MAGIC, 5, __u32)
+
+// A range of the calling process' memory.
+struct reverse_region {
+	__u64 addr;
+	__u64 len;
+};
+
+/*
+ * Reverse the phrase stored in a range of the caller's memory in place,
+ * using the delimiters of this fd. Nothing is copied: the pages are pinned
+ * and worked on directly. Not available in the UTF-8 modes.
+ */
+#define REVERSE_IOC_REVERSE_USER _IOW(REVERSE_IOC_MAGIC, 6, struct reverse_region)
+
+/*
+ * Set the time in microseconds a reader of this fd spins waiting for data
+ * before going to sleep, 0 to sleep right away. The default comes from the
+ * busy_poll module parameter.
+ */
+#define REVERSE_IOC_SET_BUSY_POLL _IOW(REVERSE_IOC_MAGIC, 7, __u32)
+
+// Get the busy poll time of this fd.
+#define REVERSE_IOC_GET_BUSY_POLL _IOR(REVERSE_IOC_MAGIC, 8, __u32)
+
+/*
+ * Priority classes. By default a message is reversed right in write().
+ * In the other classes write() returns as soon as the message is copied in,
+ * and the reversal is done in the background; the message becomes readable
+ * once it is complete. Interactive work always goes before normal work,
+ * which goes before bulk work. Bulk messages are reversed in time slices,
+ * so that a large one can't hold up more urgent work for long.
+ *
+ * Within a class, messages with the earliest deadline go first. The
+ * deadline is in microseconds from the write(), 0 for none.
+ *
+ * An error found in the background (such as invalid UTF-8) drops the
+ * message and is returned by the next write().
+ */
+#define REVERSE_PRIO_SYNC		0
+#define REVERSE_PRIO_INTERACTIVE	1
+#define REVERSE_PRIO_NORMAL		2
+#define REVERSE_PRIO_BULK		3
+
+struct reverse_sched {
+	__u32 prio;
+	__u32 deadline;
+};
+
+// Set the priority class and deadline of this fd.
+#define REVERSE_IOC_SET_SCHED _IOW(REVERSE_IOC_MAGIC, 9, struct reverse_sched)
+
+// Get the priority class and deadline of this fd.
+#define REVERSE_IOC_GET_SCHED _IOR(REVERSE_IOC_MAGIC, 10, struct reverse_sched)
+
+/*
+ * Set the buffer size of this fd, the longest message it can take. It has
+ * to be within the buffer_size_min and buffer_size_max module parameters.
+ * The message being read and an incomplete record are kept; if they don't
+ * fit, this fails with EBUSY. New fds start with buffer_size bytes.
+ *
+ * With the spill_threshold module parameter set, phrases longer than that
+ * are kept in swappable shmem instead, and may be up to spill_size_max
+ * bytes whatever the buffer size. This doesn't apply to framing, the UTF-8
+ * modes, REVERSE_MODE_LAZY or REVERSE_MODE_APPEND.
+ */
+#define REVERSE_IOC_SET_SIZE _IOW(REVERSE_IOC_MAGIC, 11, __u64)
+
+// Get the buffer size of this fd.
+#define REVERSE_IOC_GET_SIZE _IOR(REVERSE_IOC_MAGIC, 12, __u64)
+
+/*
+ * Mode flags:
+ *
+ * REVERSE_MODE_SEEKABLE - the current result reads like a file: read()
+ *                         starts at the file position and pread() works
+ *                         at any offset, with no single read cursor, so
+ *                         threads sharing the fd read slices in parallel.
+ *                         Reads past the end return 0, SEEK_END is the
+ *                         length of the result.
+ * REVERSE_MODE_LAZY - write() only indexes the words of the message, and
+ *                     reads reverse just the part of it they return, so
+ *                     a result that is never read in full never costs
+ *                     the full price. Not available with framing.
+ * REVERSE_MODE_APPEND - every write is added to the end of the phrase so
+ *                       far instead of replacing it, for the price of
+ *                       the bytes written. Setting it starts an empty
+ *                       phrase of up to the buffer size. Not available
+ *                       with framing, REVERSE_MODE_LAZY or
+ *                       REVERSE_UTF8_GRAPHEME.
+ * REVERSE_MODE_STAMPS - every message is stamped with the times it went
+ *                       through the driver, see REVERSE_IOC_GET_STAMPS.
+ * REVERSE_MODE_CRC - a CRC32C of every result is computed as it is being
+ *                    reversed, see REVERSE_IOC_GET_CRC. Not available with
+ *                    REVERSE_MODE_LAZY or REVERSE_MODE_APPEND.
+ */
+#define REVERSE_MODE_SEEKABLE	(1 << 0)
+#define REVERSE_MODE_LAZY	(1 << 1)
+#define REVERSE_MODE_APPEND	(1 << 2)
+#define REVERSE_MODE_STAMPS	(1 << 3)
+#define REVERSE_MODE_CRC	(1 << 4)
+
+// Set the mode flags of this fd.
+#define REVERSE_IOC_SET_MODE _IOW(REVERSE_IOC_MAGIC, 13, __u32)
+
+// Get the mode flags of this fd.
+#define REVERSE_IOC_GET_MODE _IOR(REVERSE_IOC_MAGIC, 14, __u32)
+
+/*
+ * Export the current result as a new read-only fd on a shmem file, sealed
+ * with F_SEAL_SEAL, F_SEAL_SHRINK, F_SEAL_GROW and F_SEAL_WRITE, that can
+ * be passed to another process and mmap()ed there. A result kept in shmem
+ * (see REVERSE_IOC_SET_SIZE) is exported as it is, with nothing copied;
+ * any other result is copied into a new file. Waits for the message being
+ * written, if any.
+ */
+struct reverse_export {
+	__u32 flags;	// in: O_CLOEXEC or 0
+	__s32 fd;	// out
+	__u64 len;	// out: the length of the result
+};
+
+#define REVERSE_IOC_EXPORT _IOWR(REVERSE_IOC_MAGIC, 15, struct reverse_export)
+
+/*
+ * Wakeup coalescing, like interrupt moderation: a reader sleeping on this
+ * fd is woken once @max_batch messages have been published, or @max_delay
+ * microseconds after the first of them, whichever comes first, rather than
+ * for every message. Readers that are awake still see each message as soon
+ * as it is published. A @max_batch of 0 or 1, the default, turns it off;
+ * otherwise @max_delay has to be between 1 and 1000000.
+ *
+ * Each message replaces the previous result, so a reader woken for a batch
+ * would only find the last message of it. Coalescing is therefore limited
+ * to REVERSE_MODE_APPEND, where every message adds to the output: setting
+ * @max_batch above 1 fails with EINVAL in any other mode, and so does
+ * leaving REVERSE_MODE_APPEND while coalescing is on.
+ */
+struct reverse_coalesce {
+	__u32 max_batch;
+	__u32 max_delay;
+};
+
+// Set the wakeup coalescing parameters of this fd.
+#define REVERSE_IOC_SET_COALESCE _IOW(REVERSE_IOC_MAGIC, 16, struct reverse_coalesce)
+
+// Get the wakeup coalescing parameters of this fd.
+#define REVERSE_IOC_GET_COALESCE _IOR(REVERSE_IOC_MAGIC, 17, struct reverse_coalesce)
+
+/*
+ * Where the current message has spent its time, in CLOCK_MONOTONIC
+ * nanoseconds. From @write to @reverse_start it was queued, waiting for
+ * the fd or for a background worker; from @reverse_start to @reverse_end
+ * it was reversed (in REVERSE_MODE_LAZY, indexed); from @reverse_end to
+ * @first_read it waited for the reader.
+ */
+struct reverse_stamps {
+	__u64 write;		// write() was called
+	__u64 reverse_start;
+	__u64 reverse_end;	// the message was published
+	__u64 first_read;	// the first read that got data, 0 if none yet
+};
+
+/*
+ * Get the stamps of the current message. Fails with ENODATA if it was
+ * written outside REVERSE_MODE_STAMPS. Waits for the message being
+ * written, if any.
+ */
+#define REVERSE_IOC_GET_STAMPS _IOR(REVERSE_IOC_MAGIC, 18, struct reverse_stamps)
+
+/*
+ * Get the CRC-32C (Castagnoli, as in iSCSI) of the current result, all of
+ * it as read() returns it. Fails with ENODATA if the message was written
+ * outside REVERSE_MODE_CRC. Waits for the message being written, if any.
+ */
+#define REVERSE_IOC_GET_CRC _IOR(REVERSE_IOC_MAGIC, 19, __u32)
+
+/*
+ * Generic netlink interface. A REVERSE_CMD_REVERSE request carries any
+ * number of REVERSE_ATTR_DATA attributes, reversed with the optional
+ * REVERSE_ATTR_DELIMS and REVERSE_ATTR_UTF8. The results are multicast to
+ * the REVERSE_GENL_MCGRP_NAME group as one REVERSE_CMD_RESULT message with
+ * the REVERSE_ATTR_DATA attributes in the same order; its header has the
+ * port id and sequence number of the request. Both the request and the
+ * group need CAP_NET_ADMIN, like /dev/reverse needs root by default.
+ */
+#define REVERSE_GENL_NAME	"reverse"
+#define REVERSE_GENL_VERSION	1
+#define REVERSE_GENL_MCGRP_NAME	"results"
+
+enum {
+	REVERSE_CMD_UNSPEC,
+	REVERSE_CMD_REVERSE,
+	REVERSE_CMD_RESULT,
+	__REVERSE_CMD_MAX
+};
+#define REVERSE_CMD_MAX (__REVERSE_CMD_MAX - 1)
+
+enum {
+	REVERSE_ATTR_UNSPEC,
+	REVERSE_ATTR_DATA,	// binary, one per phrase
+	REVERSE_ATTR_DELIMS,	// struct reverse_delims
+	REVERSE_ATTR_UTF8,	// __u32, REVERSE_UTF8_*
+	__REVERSE_ATTR_MAX
+};
+#define REVERSE_ATTR_MAX (__REVERSE_ATTR_MAX - 1)
+
+#ifdef __KERNEL__
+
+/*
+ * The in-kernel API exported by reverse.ko. Data is reversed in place,
+ * with the words delimited by @delims, or by a space if @delims is NULL.
+ */
+struct scatterlist;
+
+// Reverse @len bytes at @data. May sleep.
+int reverse_buffer(char *data, size_t len, const struct reverse_delims *delims);
+
+// Reverse the first @len bytes described by a scatterlist. May sleep.
+int reverse_sg(struct scatterlist *sgl, unsigned int nents, size_t len,
+	       const struct reverse_delims *delims);
+
+/*
+ * A request for the background workers. Either @data or @sg is set.
+ * @complete is called in process context once the data is reversed, with
+ * 0 or an error; until then the request and the data must stay around.
+ * A module that submits requests must wait for all of them to complete
+ * before it is unloaded.
+ */
+struct reverse_request {
+	char *data;
+	struct scatterlist *sg;
+	unsigned int nents;
+	size_t len;
+	const struct reverse_delims *delims;
+	struct reverse_sched sched;	// any class but REVERSE_PRIO_SYNC
+	void (*complete)(struct reverse_request *req, int err);
+	void *context;			// for the caller's use
+};
+
+/*
+ * Queue up a request. Returns 0 or an error, in which case it never completes.
+ * Safe in atomic context, softirqs and hardirqs included, with a @gfp that
+ * doesn't sleep, such as GFP_ATOMIC.
+ */
+int reverse_submit(struct reverse_request *req, gfp_t gfp);
+
+#endif
+
+#endif
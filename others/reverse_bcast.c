@@ -0,0 +1,232 @@
+#include <linux/kernel.h>	/* min() and container_of() */
+#include <linux/module.h>	/* THIS_MODULE */
+
+#include <linux/fs.h>		/* struct file_operations, struct file */
+#include <linux/miscdevice.h>	/* struct miscdevice and misc_[de]register() */
+#include <linux/mutex.h>	/* mutexes */
+#include <linux/kref.h>		/* reference counted messages */
+#include <linux/rcupdate.h>	/* RCU-protected current message pointer */
+#include <linux/wait.h>		/* wait queues */
+#include <linux/slab.h>		/* kzalloc() function */
+#include <linux/uaccess.h>	/* copy_{to,from}_user() */
+
+#include "reverse_internal.h"	/* the reversal engine */
+
+/*
+ * Broadcast mode: every write to /dev/reverse_bcast is reversed once and
+ * published as the current message. Each open fd is a subscriber with its
+ * own cursor into the message it is reading, so the cost of a message does
+ * not depend on the number of subscribers. A subscriber that is slower than
+ * the publisher finishes the message it holds and then skips to the latest
+ * one, like a reader of /dev/reverse does.
+ */
+struct bcast_msg {
+	struct kref ref;
+	struct rcu_head rcu;
+	unsigned long seq;
+	size_t len;
+	char data[];
+};
+
+struct bcast_reader {
+	struct mutex lock;
+	struct bcast_msg *msg;
+	unsigned long seq;
+	size_t pos;
+};
+
+static struct bcast_msg __rcu *bcast_current;
+static unsigned long bcast_seq;
+static DEFINE_MUTEX(bcast_lock);	/* serializes publishers */
+static DECLARE_WAIT_QUEUE_HEAD(bcast_queue);
+
+static void bcast_msg_release(struct kref *ref)
+{
+	struct bcast_msg *msg = container_of(ref, struct bcast_msg, ref);
+
+	/* Readers may still be looking at it under rcu_read_lock() */
+	kvfree_rcu(msg, rcu);
+}
+
+static inline void bcast_msg_put(struct bcast_msg *msg)
+{
+	if (msg)
+		kref_put(&msg->ref, bcast_msg_release);
+}
+
+/* Grab a reference to the current message if it is newer than @seq */
+static struct bcast_msg *bcast_msg_get(unsigned long seq)
+{
+	struct bcast_msg *msg;
+
+	rcu_read_lock();
+	msg = rcu_dereference(bcast_current);
+	if (msg && (msg->seq == seq || !kref_get_unless_zero(&msg->ref)))
+		msg = NULL;
+	rcu_read_unlock();
+
+	return msg;
+}
+
+static int reverse_bcast_open(struct inode *inode, struct file *file)
+{
+	struct bcast_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (unlikely(!reader))
+		return -ENOMEM;
+
+	mutex_init(&reader->lock);
+
+	/* Subscribers only see messages published after they've opened */
+	reader->seq = READ_ONCE(bcast_seq);
+
+	file->private_data = reader;
+
+	return 0;
+}
+
+static ssize_t reverse_bcast_read(struct file *file, char __user * out,
+				  size_t size, loff_t * off)
+{
+	struct bcast_reader *reader = file->private_data;
+	struct bcast_msg *msg;
+	ssize_t result;
+
+	if (mutex_lock_interruptible(&reader->lock)) {
+		result = -ERESTARTSYS;
+		goto out;
+	}
+
+	while (!reader->msg || reader->pos == reader->msg->len) {
+		msg = bcast_msg_get(reader->seq);
+		if (msg) {
+			bcast_msg_put(reader->msg);
+			reader->msg = msg;
+			reader->seq = msg->seq;
+			reader->pos = 0;
+			continue;
+		}
+
+		mutex_unlock(&reader->lock);
+		if (file->f_flags & O_NONBLOCK) {
+			result = -EAGAIN;
+			goto out;
+		}
+		if (wait_event_interruptible
+		    (bcast_queue, READ_ONCE(bcast_seq) != reader->seq)) {
+			result = -ERESTARTSYS;
+			goto out;
+		}
+		if (mutex_lock_interruptible(&reader->lock)) {
+			result = -ERESTARTSYS;
+			goto out;
+		}
+	}
+
+	msg = reader->msg;
+	size = min(size, msg->len - reader->pos);
+	if (copy_to_user(out, msg->data + reader->pos, size)) {
+		result = -EFAULT;
+		goto out_unlock;
+	}
+
+	reader->pos += size;
+	result = size;
+
+ out_unlock:
+	mutex_unlock(&reader->lock);
+ out:
+	return result;
+}
+
+static ssize_t reverse_bcast_write(struct file *file, const char __user * in,
+				   size_t size, loff_t * off)
+{
+	struct bcast_msg *msg, *old;
+	ssize_t result;
+
+	if (size > READ_ONCE(buffer_size)) {
+		result = -EFBIG;
+		goto out;
+	}
+
+	msg = kvmalloc(struct_size(msg, data, size), GFP_KERNEL);
+	if (unlikely(!msg)) {
+		result = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(msg->data, in, size)) {
+		result = -EFAULT;
+		goto out_free;
+	}
+
+	kref_init(&msg->ref);
+	msg->len = size;
+
+	/* The only reversal this message will ever need */
+	reverse_message(msg->data, size, &default_delims);
+
+	if (mutex_lock_interruptible(&bcast_lock)) {
+		result = -ERESTARTSYS;
+		goto out_free;
+	}
+
+	msg->seq = bcast_seq + 1;
+	old = rcu_dereference_protected(bcast_current,
+					lockdep_is_held(&bcast_lock));
+	rcu_assign_pointer(bcast_current, msg);
+	WRITE_ONCE(bcast_seq, msg->seq);
+
+	mutex_unlock(&bcast_lock);
+
+	bcast_msg_put(old);
+	wake_up_interruptible_all(&bcast_queue);
+
+	result = size;
+ out:
+	return result;
+
+ out_free:
+	kvfree(msg);
+	return result;
+}
+
+static int reverse_bcast_close(struct inode *inode, struct file *file)
+{
+	struct bcast_reader *reader = file->private_data;
+
+	bcast_msg_put(reader->msg);
+	kfree(reader);
+
+	return 0;
+}
+
+static struct file_operations reverse_bcast_fops = {
+	.owner = THIS_MODULE,
+	.open = reverse_bcast_open,
+	.read = reverse_bcast_read,
+	.write = reverse_bcast_write,
+	.release = reverse_bcast_close,
+	.llseek = noop_llseek
+};
+
+static struct miscdevice reverse_bcast_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "reverse_bcast",
+	.fops = &reverse_bcast_fops
+};
+
+int __init reverse_bcast_init(void)
+{
+	return misc_register(&reverse_bcast_device);
+}
+
+void reverse_bcast_exit(void)
+{
+	misc_deregister(&reverse_bcast_device);
+
+	/* Nobody can subscribe any more, drop the last published message */
+	bcast_msg_put(rcu_dereference_protected(bcast_current, 1));
+}
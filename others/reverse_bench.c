@@ -0,0 +1,275 @@
+#include <linux/kernel.h>	/* KERN_WARNING macros */
+#include <linux/module.h>	/* required for all kernel modules */
+#include <linux/moduleparam.h>	/* module_param() and MODULE_PARM_DESC() */
+
+#include <linux/mutex.h>	/* bench_lock */
+#include <linux/proc_fs.h>	/* /proc/reverse/bench */
+#include <linux/seq_file.h>	/* seq_printf() */
+#include <linux/slab.h>		/* kvmalloc() function */
+#include <linux/jump_label.h>	/* static keys for the benchmark's picks */
+#include <linux/timex.h>	/* get_cycles() */
+#include <linux/sched/clock.h>	/* local_clock() */
+#include <linux/math64.h>	/* div64_u64() */
+
+#include "reverse_internal.h"	/* the reversal engine */
+
+static bool bench;
+module_param(bench, bool, (S_IRUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(bench, "Benchmark the reversal code at load time and use the fastest");
+
+/*
+ * Self-benchmark, in the spirit of rdtscmod from the LDD samples: each
+ * implementation of the hot loops is timed with the cycle counter (minus
+ * the cost of reading it) and the clock, over payloads of several sizes,
+ * and the fastest one is put to use. The results are in /proc/reverse/bench;
+ * writing to that file runs the benchmark again.
+ */
+#define BENCH_BYTES	(1 << 20)	/* worth of work per sample */
+#define BENCH_REPS	5		/* samples per run, the best one counts */
+
+enum {
+	BENCH_WORD_BYTES,
+	BENCH_WORD_SWAB,
+	BENCH_SCAN_SWAR,	/* one per number of delimiters */
+	BENCH_SCAN_BITMAP = BENCH_SCAN_SWAR + DELIM_SWAR_MAX,
+	NR_BENCH = BENCH_SCAN_BITMAP + DELIM_SWAR_MAX
+};
+
+static const size_t bench_sizes[] = { 64, 1024, 16384, 262144 };
+static const char bench_delims[DELIM_SWAR_MAX] = { ' ', ',', '.', ';' };
+
+/* Thousandths of a ns and of a cycle per byte, 0 if not run */
+struct bench_result {
+	u64 ps;
+	u64 mcycles;
+};
+
+static struct bench_result bench_results[NR_BENCH][ARRAY_SIZE(bench_sizes)];
+static DEFINE_MUTEX(bench_lock);
+static u32 bench_sink;
+
+static void bench_one(unsigned int v, char *p, size_t len,
+		      const struct delim_set *sets)
+{
+	const struct delim_set *set;
+	size_t i;
+	u32 mask = 0;
+
+	if (v == BENCH_WORD_BYTES) {
+		reverse_bytes(p, p + len - 1);
+		return;
+	}
+	if (v == BENCH_WORD_SWAB) {
+		reverse_swab(p, p + len - 1);
+		return;
+	}
+
+	if (v < BENCH_SCAN_BITMAP) {
+		set = &sets[v - BENCH_SCAN_SWAR];
+		for (i = 0; i + DELIM_SCAN_BYTES <= len; i += DELIM_SCAN_BYTES)
+			mask ^= delim_scan_swar(set, p + i);
+	} else {
+		set = &sets[v - BENCH_SCAN_BITMAP];
+		for (i = 0; i + DELIM_SCAN_BYTES <= len; i += DELIM_SCAN_BYTES)
+			mask ^= delim_scan_bitmap(set, p + i);
+	}
+
+	/* Keep the compiler from dropping the scan */
+	WRITE_ONCE(bench_sink, mask);
+}
+
+/* Words of 1 to 12 letters, split up by all of bench_delims */
+static void bench_fill(char *p, size_t len)
+{
+	u32 x = 2463534242U;
+	size_t i, word = 0;
+
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		if (word && x % 12 < word) {
+			p[i] = bench_delims[(x >> 8) % DELIM_SWAR_MAX];
+			word = 0;
+		} else {
+			p[i] = 'a' + (x >> 8) % 26;
+			word++;
+		}
+	}
+}
+
+static u64 bench_sum(unsigned int v)
+{
+	u64 sum = 0;
+	size_t s;
+
+	for (s = 0; s < ARRAY_SIZE(bench_sizes); s++)
+		sum += bench_results[v][s].ps;
+
+	return sum;
+}
+
+/* Put the fastest implementations to use, all sizes weighing the same */
+static void bench_select(void)
+{
+	unsigned int n;
+
+	if (bench_sum(BENCH_WORD_SWAB) < bench_sum(BENCH_WORD_BYTES))
+		static_branch_enable(&reverse_word_swab);
+	else
+		static_branch_disable(&reverse_word_swab);
+
+	/* SWAR gets slower with every delimiter, the bitmap doesn't */
+	for (n = 0; n < DELIM_SWAR_MAX; n++)
+		if (bench_sum(BENCH_SCAN_SWAR + n) >=
+		    bench_sum(BENCH_SCAN_BITMAP + n))
+			break;
+	WRITE_ONCE(delim_swar_max, n);
+}
+
+static int reverse_bench(void)
+{
+	struct delim_set sets[DELIM_SWAR_MAX];
+	struct reverse_delims delims = { };
+	u64 ns, best_ns, best_cycles;
+	cycles_t c0, c1, fix = ~(cycles_t)0;
+	size_t size = bench_sizes[ARRAY_SIZE(bench_sizes) - 1];
+	unsigned int v, s, r, i, n;
+	char *data;
+
+	data = kvmalloc(size, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	bench_fill(data, size);
+
+	for (n = 0; n < DELIM_SWAR_MAX; n++) {
+		delims.map[bench_delims[n] / 64] |= 1ULL << (bench_delims[n] % 64);
+		delim_set_init(&sets[n], &delims, REVERSE_UTF8_NONE);
+	}
+
+	/* What reading the counter costs by itself */
+	for (r = 0; r < BENCH_REPS; r++) {
+		c0 = get_cycles();
+		c1 = get_cycles();
+		fix = min(fix, c1 - c0);
+	}
+
+	mutex_lock(&bench_lock);
+
+	for (v = 0; v < NR_BENCH; v++) {
+		for (s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+			size = bench_sizes[s];
+			n = BENCH_BYTES / size;
+			best_ns = best_cycles = U64_MAX;
+
+			for (r = 0; r < BENCH_REPS; r++) {
+				preempt_disable();
+				ns = local_clock();
+				c0 = get_cycles();
+				for (i = 0; i < n; i++)
+					bench_one(v, data, size, sets);
+				c1 = get_cycles();
+				ns = local_clock() - ns;
+				preempt_enable();
+
+				best_ns = min(best_ns, ns);
+				best_cycles = min_t(u64, best_cycles,
+						    c1 - c0 - min(fix, c1 - c0));
+				cond_resched();
+			}
+
+			bench_results[v][s].ps = div64_u64(best_ns * 1000,
+							   (u64)n * size);
+			bench_results[v][s].mcycles =
+			    div64_u64(best_cycles * 1000, (u64)n * size);
+		}
+	}
+
+	bench_select();
+
+	mutex_unlock(&bench_lock);
+
+	kvfree(data);
+	return 0;
+}
+
+static void bench_show_name(struct seq_file *m, unsigned int v)
+{
+	if (v == BENCH_WORD_BYTES)
+		seq_puts(m, "word_bytes -");
+	else if (v == BENCH_WORD_SWAB)
+		seq_puts(m, "word_swab -");
+	else if (v < BENCH_SCAN_BITMAP)
+		seq_printf(m, "scan_swar %u", v - BENCH_SCAN_SWAR + 1);
+	else
+		seq_printf(m, "scan_bitmap %u", v - BENCH_SCAN_BITMAP + 1);
+}
+
+static int reverse_bench_show(struct seq_file *m, void *v)
+{
+	struct bench_result *res;
+	unsigned int i, s;
+
+	mutex_lock(&bench_lock);
+
+	seq_printf(m, "word %s\n", static_key_enabled(&reverse_word_swab) ?
+		   "swab" : "bytes");
+	seq_printf(m, "delim_swar_max %u\n", READ_ONCE(delim_swar_max));
+
+	seq_puts(m, "# variant delims size ns/byte cycles/byte\n");
+	for (i = 0; i < NR_BENCH; i++) {
+		for (s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+			res = &bench_results[i][s];
+			if (!res->ps)
+				continue;
+			bench_show_name(m, i);
+			seq_printf(m, " %zu %llu.%03llu %llu.%03llu\n",
+				   bench_sizes[s], res->ps / 1000,
+				   res->ps % 1000, res->mcycles / 1000,
+				   res->mcycles % 1000);
+		}
+	}
+
+	mutex_unlock(&bench_lock);
+
+	return 0;
+}
+
+static int reverse_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, reverse_bench_show, NULL);
+}
+
+/* Any write runs the benchmark again */
+static ssize_t reverse_bench_write(struct file *file, const char __user *in,
+				   size_t size, loff_t *off)
+{
+	int err;
+
+	err = reverse_bench();
+	if (err)
+		return err;
+
+	return size;
+}
+
+static const struct proc_ops reverse_bench_proc_ops = {
+	.proc_open = reverse_bench_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_write = reverse_bench_write,
+	.proc_release = single_release,
+};
+
+int __init reverse_bench_init(void)
+{
+	if (!proc_create("bench", S_IRUGO | S_IWUSR, reverse_proc_dir,
+			 &reverse_bench_proc_ops))
+		return -ENOMEM;
+
+	/* Not worth failing the load for, the defaults work everywhere */
+	if (bench && reverse_bench())
+		printk(KERN_WARNING "reverse: self-benchmark failed\n");
+
+	return 0;
+}
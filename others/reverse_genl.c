@@ -0,0 +1,135 @@
+#include <linux/kernel.h>	/* ARRAY_SIZE() */
+#include <linux/module.h>	/* THIS_MODULE */
+#include <linux/string.h>	/* memcpy() function */
+#include <net/genetlink.h>	/* generic netlink family */
+
+#include "reverse_internal.h"	/* the reversal engine */
+
+/*
+ * Generic netlink: a request is a batch of phrases, and all the results
+ * go out to every subscriber of the results group in a single message.
+ */
+enum {
+	REVERSE_GENL_MCGRP_RESULTS,
+};
+
+static const struct genl_multicast_group reverse_genl_mcgrps[] = {
+	[REVERSE_GENL_MCGRP_RESULTS] = {
+		.name = REVERSE_GENL_MCGRP_NAME,
+		.flags = GENL_MCAST_CAP_NET_ADMIN,
+	},
+};
+
+static const struct nla_policy reverse_genl_policy[REVERSE_ATTR_MAX + 1] = {
+	[REVERSE_ATTR_DATA] = { .type = NLA_BINARY },
+	[REVERSE_ATTR_DELIMS] = NLA_POLICY_EXACT_LEN(sizeof(struct reverse_delims)),
+	[REVERSE_ATTR_UTF8] = NLA_POLICY_MAX(NLA_U32, REVERSE_UTF8_GRAPHEME),
+};
+
+static struct genl_family reverse_genl_family;
+
+static int reverse_genl_reverse(struct sk_buff *skb, struct genl_info *info)
+{
+	struct reverse_delims delims = default_delims.delims;
+	struct delim_set set = default_delims;
+	u32 utf8 = REVERSE_UTF8_NONE;
+	struct nlattr *attr, *out;
+	struct sk_buff *msg;
+	size_t size = 0;
+	void *hdr;
+	int rem, err;
+
+	if (info->attrs[REVERSE_ATTR_DELIMS])
+		nla_memcpy(&delims, info->attrs[REVERSE_ATTR_DELIMS],
+			   sizeof(delims));
+	if (info->attrs[REVERSE_ATTR_UTF8])
+		utf8 = nla_get_u32(info->attrs[REVERSE_ATTR_UTF8]);
+	if (info->attrs[REVERSE_ATTR_DELIMS] || utf8 != REVERSE_UTF8_NONE) {
+		err = delim_set_init(&set, &delims, utf8);
+		if (err) {
+			GENL_SET_ERR_MSG(info, "invalid delimiters for the UTF-8 mode");
+			return err;
+		}
+	}
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != REVERSE_ATTR_DATA)
+			continue;
+		if (nla_len(attr) > READ_ONCE(buffer_size)) {
+			NL_SET_ERR_MSG_ATTR(info->extack, attr, "phrase too long");
+			return -EFBIG;
+		}
+		if (utf8 != REVERSE_UTF8_NONE &&
+		    !utf8_valid(nla_data(attr), nla_len(attr))) {
+			NL_SET_ERR_MSG_ATTR(info->extack, attr, "invalid UTF-8");
+			return -EILSEQ;
+		}
+		size += nla_total_size(nla_len(attr));
+	}
+
+	msg = genlmsg_new(size, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq,
+			  &reverse_genl_family, 0, REVERSE_CMD_RESULT);
+	if (!hdr) {
+		err = -EMSGSIZE;
+		goto out_free;
+	}
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != REVERSE_ATTR_DATA)
+			continue;
+
+		out = nla_reserve(msg, REVERSE_ATTR_DATA, nla_len(attr));
+		if (!out) {
+			err = -EMSGSIZE;
+			goto out_free;
+		}
+		memcpy(nla_data(out), nla_data(attr), nla_len(attr));
+		reverse_message(nla_data(out), nla_len(out), &set);
+	}
+
+	genlmsg_end(msg, hdr);
+
+	/* Nobody listening isn't an error, the request has been served */
+	err = genlmsg_multicast(&reverse_genl_family, msg, 0,
+				REVERSE_GENL_MCGRP_RESULTS, GFP_KERNEL);
+	return err == -ESRCH ? 0 : err;
+
+ out_free:
+	nlmsg_free(msg);
+	return err;
+}
+
+static const struct genl_small_ops reverse_genl_ops[] = {
+	{
+		.cmd = REVERSE_CMD_REVERSE,
+		.doit = reverse_genl_reverse,
+		.flags = GENL_ADMIN_PERM,
+	},
+};
+
+static struct genl_family reverse_genl_family __ro_after_init = {
+	.name = REVERSE_GENL_NAME,
+	.version = REVERSE_GENL_VERSION,
+	.maxattr = REVERSE_ATTR_MAX,
+	.policy = reverse_genl_policy,
+	.module = THIS_MODULE,
+	.small_ops = reverse_genl_ops,
+	.n_small_ops = ARRAY_SIZE(reverse_genl_ops),
+	.resv_start_op = REVERSE_CMD_RESULT + 1,
+	.mcgrps = reverse_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(reverse_genl_mcgrps),
+};
+
+int __init reverse_genl_init(void)
+{
+	return genl_register_family(&reverse_genl_family);
+}
+
+void reverse_genl_exit(void)
+{
+	genl_unregister_family(&reverse_genl_family);
+}
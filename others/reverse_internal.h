@@ -0,0 +1,151 @@
+/*
+ * reverse_internal.h - What the files of the reverse module share: the
+ * reversal engine of reverse_main.c, used by the other minors, the netlink
+ * family and the benchmark. Not for userspace.
+ */
+
+#ifndef REVERSE_INTERNAL_H
+#define REVERSE_INTERNAL_H
+
+#include <linux/types.h>
+#include <linux/jump_label.h>	/* reverse_word_swab */
+#include <linux/swab.h>		/* swab64() */
+#include <linux/unaligned.h>	/* get_unaligned_le64() */
+
+#include "reverse.h"
+
+struct proc_dir_entry;
+
+/* Largest message /dev/reverse_bcast, /dev/reverse_queue and netlink take */
+extern unsigned long buffer_size;
+
+/*
+ * The set of word delimiters in a form suitable for scanning. Small sets are
+ * matched a word at a time: each delimiter is replicated into all bytes of
+ * a u64 and compared against eight input bytes at once. Larger sets fall
+ * back to testing every byte against the bitmap.
+ */
+#define DELIM_SWAR_MAX		4
+#define DELIM_SCAN_BYTES	32
+#define DELIM_REP(c)		(0x0101010101010101ULL * (u8)(c))
+#define DELIM_LOW7		DELIM_REP(0x7f)
+
+struct delim_set {
+	struct reverse_delims delims;
+	u64 key;		/* result cache key, 0 for the default set */
+	unsigned int utf8;	/* REVERSE_UTF8_* */
+	unsigned int nchars;
+	u64 rep[DELIM_SWAR_MAX];
+};
+
+extern const struct delim_set default_delims;
+extern unsigned int delim_swar_max;
+
+int delim_set_init(struct delim_set *set, const struct reverse_delims *delims,
+		   unsigned int utf8);
+
+static inline bool delim_test(const struct delim_set *set, u8 c)
+{
+	return (set->delims.map[c / 64] >> (c % 64)) & 1;
+}
+
+/* Bit i of the result is set if byte i of @v equals the byte in @rep */
+static inline unsigned int delim_mask8(u64 v, u64 rep)
+{
+	u64 x = v ^ rep, t;
+
+	/* The top bit of each byte of t is set iff that byte of x is zero */
+	t = (x & DELIM_LOW7) + DELIM_LOW7;
+	t = ~(t | x | DELIM_LOW7);
+
+	/* Gather the top bits into the low byte */
+	return ((t >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+static inline u32 delim_scan_bitmap(const struct delim_set *set,
+				    const char *p)
+{
+	unsigned int i;
+	u32 mask = 0;
+
+	for (i = 0; i < DELIM_SCAN_BYTES; i++)
+		mask |= (u32) delim_test(set, p[i]) << i;
+
+	return mask;
+}
+
+/* Only for sets of up to DELIM_SWAR_MAX delimiters */
+static inline u32 delim_scan_swar(const struct delim_set *set, const char *p)
+{
+	unsigned int i, j, bits;
+	u32 mask = 0;
+	u64 v;
+
+	for (i = 0; i < DELIM_SCAN_BYTES; i += 8) {
+		v = get_unaligned_le64(p + i);
+		for (j = 0, bits = 0; j < set->nchars; j++)
+			bits |= delim_mask8(v, set->rep[j]);
+		mask |= (u32) bits << i;
+	}
+
+	return mask;
+}
+
+static inline void reverse_bytes(char *start, char *end)
+{
+	char tmp;
+
+	for (; start < end; start++, end--) {
+		tmp = *start;
+		*start = *end;
+		*end = tmp;
+	}
+}
+
+/* Eight bytes from each end at a time, swapped and byte-swapped */
+static inline void reverse_swab(char *start, char *end)
+{
+	u64 head, tail;
+
+	for (; end - start >= 15; start += 8, end -= 8) {
+		head = get_unaligned((u64 *)start);
+		tail = get_unaligned((u64 *)(end - 7));
+		put_unaligned(swab64(tail), (u64 *)start);
+		put_unaligned(swab64(head), (u64 *)(end - 7));
+	}
+
+	reverse_bytes(start, end);
+}
+
+DECLARE_STATIC_KEY_FALSE(reverse_word_swab);
+
+bool utf8_valid(const char *p, size_t len);
+
+/* Reverse a message in place, through the result cache */
+void reverse_message_crc(char *data, size_t len, const struct delim_set *set,
+			 u32 *crc);
+
+static inline void reverse_message(char *data, size_t len,
+				   const struct delim_set *set)
+{
+	reverse_message_crc(data, len, set, NULL);
+}
+
+extern struct proc_dir_entry *reverse_proc_dir;
+
+/* reverse_bcast.c */
+int reverse_bcast_init(void);
+void reverse_bcast_exit(void);
+
+/* reverse_queue.c */
+int reverse_queue_init(void);
+void reverse_queue_exit(void);
+
+/* reverse_genl.c */
+int reverse_genl_init(void);
+void reverse_genl_exit(void);
+
+/* reverse_bench.c */
+int reverse_bench_init(void);
+
+#endif
@@ -0,0 +1,3500 @@
+#include <linux/init.h>		/* __init and __exit macroses */
+#include <linux/kernel.h>	/* KERN_INFO macros */
+#include <linux/module.h>	/* required for all kernel modules */
+#include <linux/moduleparam.h>	/* module_param() and MODULE_PARM_DESC() */
+
+#include <linux/fs.h>		/* struct file_operations, struct file */
+#include <linux/miscdevice.h>	/* struct miscdevice and misc_[de]register() */
+#include <linux/mutex.h>	/* mutexes */
+#include <linux/rwsem.h>	/* heap_sem */
+#include <linux/atomic.h>	/* cmpxchg(), smp_load_acquire() and friends */
+#include <linux/bitops.h>	/* test_and_set_bit_lock() */
+#include <linux/cache.h>	/* ____cacheline_aligned_in_smp */
+#include <linux/kref.h>		/* reference counted messages and entries */
+#include <linux/list.h>		/* job queues and the cache LRU */
+#include <linux/spinlock.h>	/* scheduler and cache locks */
+#include <linux/hashtable.h>	/* result cache */
+#include <linux/xxhash.h>	/* xxh64() */
+#include <linux/percpu.h>	/* per-CPU statistics */
+#include <linux/proc_fs.h>	/* /proc/reverse */
+#include <linux/seq_file.h>	/* seq_printf() */
+#include <linux/unaligned.h>	/* get_unaligned_le64() */
+#include <linux/mm.h>		/* pin_user_pages_fast() */
+#include <linux/highmem.h>	/* kmap_local_page() */
+#include <linux/workqueue.h>	/* background reversal */
+#include <linux/file.h>		/* fput() */
+#include <linux/timekeeping.h>	/* ktime_get_ns() */
+#include <linux/topology.h>	/* numa_node_id() */
+#include <linux/scatterlist.h>	/* for_each_sg() */
+#include <linux/export.h>	/* EXPORT_SYMBOL_GPL() */
+#include <linux/shmem_fs.h>	/* shmem_file_setup() */
+#include <linux/fcntl.h>	/* F_SEAL_* */
+#include <linux/cred.h>		/* current_cred() */
+#include <linux/hrtimer.h>	/* wakeup coalescing */
+#include <linux/log2.h>		/* ilog2() */
+#include <linux/jump_label.h>	/* static keys for the benchmark's picks */
+#include <linux/crc32.h>	/* crc32c() */
+
+#include "reverse.h"		/* ioctl definitions */
+#include "reverse_internal.h"	/* shared with the other minors */
+#include <linux/string.h>	/* memchr() function */
+#include <linux/slab.h>		/* kzalloc() function */
+#include <linux/sched.h>	/* wait queues */
+#include <linux/uaccess.h>	/* copy_{to,from}_user() */
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Valentine Sinitsyn <valentine.sinitsyn@gmail.com>");
+MODULE_DESCRIPTION("In-kernel phrase reverser");
+
+/* Larger messages belong in shmem, see spill_threshold */
+#define BUFFER_SIZE_LIMIT	(16UL << 20)
+
+static unsigned long buffer_size_min = 1;
+module_param(buffer_size_min, ulong, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(buffer_size_min, "Smallest buffer size an fd may ask for");
+
+static unsigned long buffer_size_max = 1UL << 20;
+
+unsigned long buffer_size = 8192;
+
+static int buffer_size_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned long size;
+	int err;
+
+	err = kstrtoul(val, 0, &size);
+	if (err)
+		return err;
+	if (!size || size < READ_ONCE(buffer_size_min) ||
+	    size > READ_ONCE(buffer_size_max))
+		return -EINVAL;
+
+	return param_set_ulong(val, kp);
+}
+
+static const struct kernel_param_ops buffer_size_ops = {
+	.set = buffer_size_set,
+	.get = param_get_ulong,
+};
+
+module_param_cb(buffer_size, &buffer_size_ops, &buffer_size,
+		(S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(buffer_size, "Internal buffer size for new opens, within buffer_size_min and buffer_size_max");
+
+static int buffer_size_max_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned long size;
+	int err;
+
+	err = kstrtoul(val, 0, &size);
+	if (err)
+		return err;
+	if (!size || size > BUFFER_SIZE_LIMIT)
+		return -EINVAL;
+
+	return param_set_ulong(val, kp);
+}
+
+static const struct kernel_param_ops buffer_size_max_ops = {
+	.set = buffer_size_max_set,
+	.get = param_get_ulong,
+};
+
+module_param_cb(buffer_size_max, &buffer_size_max_ops, &buffer_size_max,
+		(S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(buffer_size_max, "Largest buffer size an fd may ask for, up to 16 MiB");
+
+static unsigned long cache_size;
+module_param(cache_size, ulong, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(cache_size, "Memory cap for the result cache in bytes, 0 disables it");
+
+/* Don't let a reader spin for more than a tick's worth */
+#define BUSY_POLL_MAX	USEC_PER_MSEC
+
+static unsigned int busy_poll;
+
+static int busy_poll_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int usecs;
+	int err;
+
+	err = kstrtouint(val, 0, &usecs);
+	if (err)
+		return err;
+	if (usecs > BUSY_POLL_MAX)
+		return -EINVAL;
+
+	return param_set_uint(val, kp);
+}
+
+static const struct kernel_param_ops busy_poll_ops = {
+	.set = busy_poll_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(busy_poll, &busy_poll_ops, &busy_poll,
+		(S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(busy_poll, "Default time in us a reader spins for data before sleeping, up to 1000");
+
+static unsigned int bulk_slice = 500;
+module_param(bulk_slice, uint, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(bulk_slice, "Time slice in us for reversing bulk messages");
+
+static bool numa_migrate;
+module_param(numa_migrate, bool, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(numa_migrate, "Move buffers to the NUMA node they are mostly used from");
+
+static unsigned long spill_threshold;
+module_param(spill_threshold, ulong, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(spill_threshold, "Messages larger than this go to swappable shmem, 0 disables it");
+
+static unsigned long spill_size_max = 1UL << 30;
+module_param(spill_size_max, ulong, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(spill_size_max, "Largest message that may be spilled to shmem");
+
+/*
+ * Statistics are kept per CPU so that hot paths never share a cache line
+ * for them; /proc/reverse/stats sums them up.
+ */
+enum reverse_stat_item {
+	STAT_CACHE_HITS,
+	STAT_CACHE_MISSES,
+	STAT_CACHE_EVICTIONS,
+	STAT_READ_SPINS,
+	STAT_READ_SLEEPS,
+	STAT_ASYNC_JOBS,
+	STAT_BULK_SLICES,
+	STAT_DEADLINE_MISSES,
+	STAT_NUMA_LOCAL,
+	STAT_NUMA_REMOTE,
+	STAT_NUMA_MIGRATIONS,
+	STAT_SPILLS,
+	/* Coalesced wakeups by the number of messages, from [n, 2n) */
+	STAT_WAKEUP_BATCH_1,
+	STAT_WAKEUP_BATCH_2,
+	STAT_WAKEUP_BATCH_4,
+	STAT_WAKEUP_BATCH_8,
+	STAT_WAKEUP_BATCH_16,
+	STAT_WAKEUP_BATCH_32,
+	STAT_WAKEUP_BATCH_64,
+	STAT_WAKEUP_BATCH_128,	/* and up */
+	NR_REVERSE_STATS
+};
+
+static const char *const reverse_stat_names[NR_REVERSE_STATS] = {
+	[STAT_CACHE_HITS] = "cache_hits",
+	[STAT_CACHE_MISSES] = "cache_misses",
+	[STAT_CACHE_EVICTIONS] = "cache_evictions",
+	[STAT_READ_SPINS] = "read_spins",
+	[STAT_READ_SLEEPS] = "read_sleeps",
+	[STAT_ASYNC_JOBS] = "async_jobs",
+	[STAT_BULK_SLICES] = "bulk_slices",
+	[STAT_DEADLINE_MISSES] = "deadline_misses",
+	[STAT_NUMA_LOCAL] = "numa_local",
+	[STAT_NUMA_REMOTE] = "numa_remote",
+	[STAT_NUMA_MIGRATIONS] = "numa_migrations",
+	[STAT_SPILLS] = "spills",
+	[STAT_WAKEUP_BATCH_1] = "wakeup_batch_1",
+	[STAT_WAKEUP_BATCH_2] = "wakeup_batch_2",
+	[STAT_WAKEUP_BATCH_4] = "wakeup_batch_4",
+	[STAT_WAKEUP_BATCH_8] = "wakeup_batch_8",
+	[STAT_WAKEUP_BATCH_16] = "wakeup_batch_16",
+	[STAT_WAKEUP_BATCH_32] = "wakeup_batch_32",
+	[STAT_WAKEUP_BATCH_64] = "wakeup_batch_64",
+	[STAT_WAKEUP_BATCH_128] = "wakeup_batch_128",
+};
+
+struct reverse_stats {
+	u64 count[NR_REVERSE_STATS];
+};
+
+static DEFINE_PER_CPU(struct reverse_stats, reverse_stats);
+
+#define reverse_stat_inc(item)	this_cpu_inc(reverse_stats.count[item])
+
+const struct delim_set default_delims = {
+	.delims.map = { 1ULL << ' ' },
+	.nchars = 1,
+	.rep = { DELIM_REP(' ') },
+};
+
+int delim_set_init(struct delim_set *set, const struct reverse_delims *delims,
+		   unsigned int utf8)
+{
+	unsigned int c;
+
+	if (utf8 > REVERSE_UTF8_GRAPHEME)
+		return -EINVAL;
+
+	/* Bytes above 0x7f would split multibyte sequences */
+	if (utf8 != REVERSE_UTF8_NONE && (delims->map[2] | delims->map[3]))
+		return -EINVAL;
+
+	memset(set, 0, sizeof(*set));
+	set->delims = *delims;
+	set->utf8 = utf8;
+
+	for (c = 0; c < 256; c++) {
+		if (!(delims->map[c / 64] & (1ULL << (c % 64))))
+			continue;
+		if (set->nchars < DELIM_SWAR_MAX)
+			set->rep[set->nchars] = DELIM_REP(c);
+		set->nchars++;
+	}
+
+	if (utf8 != REVERSE_UTF8_NONE ||
+	    memcmp(delims, &default_delims.delims, sizeof(*delims)))
+		set->key = xxh64(delims, sizeof(*delims), utf8) | 1;
+
+	return 0;
+}
+
+/*
+ * Sets of up to this many delimiters are scanned with SWAR rather than
+ * the bitmap. The benchmark lowers it where the bitmap is faster.
+ */
+unsigned int delim_swar_max = DELIM_SWAR_MAX;
+
+/*
+ * Scan the DELIM_SCAN_BYTES bytes at @p in one go and return a mask with
+ * bit i set if p[i] is a delimiter.
+ */
+static inline u32 delim_scan(const struct delim_set *set, const char *p)
+{
+	if (set->nchars > READ_ONCE(delim_swar_max))
+		return delim_scan_bitmap(set, p);
+
+	return delim_scan_swar(set, p);
+}
+
+/* Same as delim_scan(), for the last @len < DELIM_SCAN_BYTES bytes */
+static inline u32 delim_scan_tail(const struct delim_set *set, const char *p,
+				  size_t len)
+{
+	u32 mask = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		mask |= (u32) delim_test(set, p[i]) << i;
+
+	return mask;
+}
+
+/*
+ * Scan the next chunk of the @left bytes at @p: DELIM_SCAN_BYTES of them,
+ * or all that is left. The chunk length goes to @chunk.
+ */
+static inline u32 delim_scan_chunk(const struct delim_set *set, const char *p,
+				   size_t left, size_t *chunk)
+{
+	if (left >= DELIM_SCAN_BYTES) {
+		*chunk = DELIM_SCAN_BYTES;
+		return delim_scan(set, p);
+	}
+
+	*chunk = left;
+	return delim_scan_tail(set, p, left);
+}
+
+/*
+ * Length of the well-formed UTF-8 sequence at @p (see RFC 3629: no
+ * overlong forms, no surrogates, nothing above U+10FFFF), or 0 if there is
+ * none. The decoded code point is stored in @cp.
+ */
+static unsigned int utf8_seq_len(const u8 *p, size_t left, u32 *cp)
+{
+	unsigned int len, i;
+	u32 c = p[0];
+
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	} else if (c >= 0xc2 && c <= 0xdf) {
+		len = 2;
+		c &= 0x1f;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		len = 3;
+		c &= 0x0f;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		len = 4;
+		c &= 0x07;
+	} else {
+		return 0;
+	}
+
+	if (left < len)
+		return 0;
+
+	for (i = 1; i < len; i++) {
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+		c = (c << 6) | (p[i] & 0x3f);
+	}
+
+	if ((len == 3 && (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))) ||
+	    (len == 4 && (c < 0x10000 || c > 0x10ffff)))
+		return 0;
+
+	*cp = c;
+	return len;
+}
+
+/*
+ * Validate @len bytes of UTF-8. ASCII is checked DELIM_SCAN_BYTES at a time
+ * by OR-ing whole words together, so only the non-ASCII spans get decoded.
+ */
+bool utf8_valid(const char *p, size_t len)
+{
+	unsigned int n;
+	u32 cp;
+
+	while (len) {
+		if (len >= DELIM_SCAN_BYTES &&
+		    !((get_unaligned_le64(p) | get_unaligned_le64(p + 8) |
+		       get_unaligned_le64(p + 16) | get_unaligned_le64(p + 24)) &
+		      DELIM_REP(0x80))) {
+			p += DELIM_SCAN_BYTES;
+			len -= DELIM_SCAN_BYTES;
+			continue;
+		}
+
+		n = utf8_seq_len((const u8 *)p, len, &cp);
+		if (!n)
+			return false;
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/*
+ * True if @p starts with a code point that extends the preceding grapheme
+ * cluster: combining marks, variation selectors, joiners and emoji
+ * modifiers. This is an approximation of Unicode's Grapheme_Extend that
+ * doesn't need the full property tables.
+ */
+static bool utf8_extends(const char *p, size_t left)
+{
+	u32 cp;
+
+	if (!left || !(*p & 0x80) || !utf8_seq_len((const u8 *)p, left, &cp))
+		return false;
+
+	return (cp >= 0x0300 && cp <= 0x036f) ||
+	    (cp >= 0x1ab0 && cp <= 0x1aff) ||
+	    (cp >= 0x1dc0 && cp <= 0x1dff) ||
+	    (cp >= 0x200c && cp <= 0x200d) ||
+	    (cp >= 0x20d0 && cp <= 0x20ff) ||
+	    (cp >= 0xfe00 && cp <= 0xfe0f) ||
+	    (cp >= 0xfe20 && cp <= 0xfe2f) ||
+	    (cp >= 0x1f3fb && cp <= 0x1f3ff) ||
+	    (cp >= 0xe0100 && cp <= 0xe01ef);
+}
+
+/*
+ * A buffer is shared by a single producer (the writer) and a single
+ * consumer (the reader). Each side keeps its state on its own cache line,
+ * so a writer and a reader running on different CPUs only touch each
+ * other's line when a message is actually handed over.
+ *
+ * The producer publishes messages through @seq: it is odd while a write is
+ * in progress and is bumped to the next even value with release semantics
+ * once @data and @end are consistent. The consumer samples @seq with
+ * acquire semantics, copies the data out and re-checks @seq afterwards; if
+ * the producer has started a new message in the meantime, the copy is
+ * simply redone against the new one.
+ *
+ * Neither side takes a lock in the common case. Only a task that finds its
+ * role already taken (two writers or two readers sharing one fd) falls back
+ * to @produce_lock or @consume_lock and sleeps on @role_queue until the role
+ * is released. The two are kept apart so that a task holding one role can
+ * wait for the other, as buffer_resize() does, without blocking on a writer
+ * that is queued for the role it holds.
+ *
+ * Messages of up to BUFFER_INLINE_SIZE bytes live in @small, right inside
+ * the buffer; the @heap buffer of @size bytes is only allocated once a
+ * larger message comes along. The producer points @data at whichever of the
+ * two holds the current message.
+ *
+ * In framed mode, an incomplete last record is kept in @carry and put in
+ * front of the next write.
+ *
+ * Outside of REVERSE_PRIO_SYNC, the writer hands the producer role over to
+ * @job along with the message, and buffer_job_finish() publishes it once the
+ * job is done. @job_file keeps the buffer around until then.
+ *
+ * The buffer is allocated on the NUMA node of the task that opens it, and
+ * so are @heap and @carry. Each side votes for the node it runs on, and
+ * with numa_migrate set, @heap and @carry follow the winner.
+ *
+ * In REVERSE_MODE_LAZY, @data holds the message as it was written and
+ * @lazy is set; readers generate the reversed output as they go, with the
+ * help of the word boundary index in @lazy_next and @lazy_prev, and the
+ * delimiters in @lazy_delims.
+ *
+ * In REVERSE_MODE_APPEND, the output grows toward the front of @heap, like
+ * a deque: @data moves down as the words of every write are put in front
+ * of it, and @end stays at the end of @heap.
+ *
+ * In REVERSE_MODE_SEEKABLE, reads don't take the consumer role: any number
+ * of them copy out of the current message in parallel, validating @seq
+ * like the consumer does. They hold @heap_sem for reading instead, so that
+ * @heap isn't reallocated under them.
+ *
+ * Messages over spill_threshold bytes are kept out of kernel memory: each
+ * one gets a shmem file of its own, @spill, and @spill_len is set instead
+ * of @data and @end. Its pages are only mapped while they are worked on, so
+ * they can be swapped out in between. @heap_sem protects @spill from being
+ * dropped while it is read from.
+ *
+ * With wakeup coalescing on, publishing a message only counts it in
+ * @coalesce_pending; sleeping readers are woken once @coalesce_batch have
+ * piled up, or by @coalesce_timer @coalesce_delay us after the first one.
+ * It takes REVERSE_MODE_APPEND, so that the output of every message stays
+ * around until it is read.
+ *
+ * In REVERSE_MODE_STAMPS, the producer stamps each message it publishes
+ * with @stamp_write, @stamp_start and @stamp_end. The first reader to get
+ * data out of it takes @stamp_lock and stamps @stamp_read, along with the
+ * seq of the message in @stamp_read_seq.
+ *
+ * In REVERSE_MODE_CRC, @crc collects a CRC32C of the output as it is
+ * produced, and @has_crc says whether the published message has one.
+ */
+#define BUFFER_INLINE_SIZE	128
+#define LAZY_BLOCK		64
+#define LAZY_CHUNK		256
+
+/* Wins in a row, in effect, that another node needs to get the buffer */
+#define NUMA_MIGRATE_VOTES	64
+
+struct numa_vote {
+	int node;
+	unsigned int votes;
+};
+
+/* Where reverse_phrase_step() has left off */
+struct reverse_state {
+	size_t pos;
+	size_t word_start;
+	bool words;		/* the whole phrase is reversed, now the words */
+	u32 *crc;		/* a CRC32C of the output goes here, if set */
+	size_t crc_pos;		/* the output up to here is in *@crc */
+};
+
+/*
+ * A piece of background work. Jobs are reversed with ->reverse() in one go,
+ * except for sliced ones, which are contiguous phrases at @data reversed
+ * with reverse_phrase_step() a time slice at a time. Either way ->finish()
+ * gets the result; the job may be reused or freed as soon as it is called.
+ */
+struct reverse_job {
+	struct list_head list;
+	char *data;
+	size_t len;
+	const struct delim_set *set;
+	ssize_t (*reverse)(struct reverse_job *job);
+	void (*finish)(struct reverse_job *job, ssize_t result);
+	unsigned int prio;
+	int node;
+	u64 deadline;		/* ktime_get_ns(), U64_MAX for none */
+	bool sliced;
+	bool started;
+	u64 start_time;		/* ktime_get_ns() of the first run */
+	u32 *crc;		/* for sliced jobs, see struct reverse_state */
+	struct reverse_state state;
+	struct cache_entry *entry;
+};
+
+struct buffer {
+	/* Producer side */
+	unsigned long seq ____cacheline_aligned_in_smp;
+	char *data, *end;
+	bool lazy;		/* @data is still to be reversed */
+	size_t spill_len;	/* the message is in @spill instead */
+	size_t append_tail;	/* unfinished word at the front of the output */
+	char *carry;
+	size_t carry_len;
+	struct numa_vote write_vote;
+	u64 stamp_write, stamp_start, stamp_end;	/* 0 if not stamped */
+	u32 crc;		/* not inverted yet */
+	bool has_crc;
+
+	/* Consumer side */
+	unsigned long read_seq ____cacheline_aligned_in_smp;
+	size_t read_pos;
+	unsigned long reading;
+	unsigned int busy_poll;	/* us to spin before sleeping */
+	struct numa_vote read_vote;
+	unsigned long stamp_read_seq;
+	u64 stamp_read;
+
+	/* Slow path and read-mostly state */
+	wait_queue_head_t read_queue ____cacheline_aligned_in_smp;
+	wait_queue_head_t role_queue;
+	struct mutex produce_lock;
+	struct mutex consume_lock;
+	struct rw_semaphore heap_sem;
+	spinlock_t stamp_lock;
+	char *heap;
+	struct file *spill;
+	u32 *lazy_next, *lazy_prev;
+	struct delim_set lazy_delims;	/* the lazy message was written with */
+	unsigned long size;
+	int node;
+	unsigned int mode;	/* REVERSE_MODE_* */
+	unsigned int framing;
+	struct delim_set delims;
+	struct reverse_sched sched;
+	struct reverse_job job;
+	struct file *job_file;
+	unsigned long job_seq;
+	int error;		/* of the last background reversal */
+	unsigned int coalesce_batch;
+	unsigned int coalesce_delay;
+	atomic_t coalesce_pending;
+	struct hrtimer coalesce_timer;
+
+	char small[BUFFER_INLINE_SIZE] ____cacheline_aligned_in_smp;
+};
+
+static enum hrtimer_restart buffer_coalesce_timer(struct hrtimer *timer);
+
+static struct buffer *buffer_alloc(unsigned long size)
+{
+	struct buffer *buf = NULL;
+	int node = numa_node_id();
+
+	buf = kzalloc_node(sizeof(*buf), GFP_KERNEL, node);
+	if (unlikely(!buf))
+		goto out;
+
+	buf->node = node;
+
+	buf->data = buf->end = buf->small;
+	buf->delims = default_delims;
+	buf->busy_poll = READ_ONCE(busy_poll);
+
+	init_waitqueue_head(&buf->read_queue);
+	init_waitqueue_head(&buf->role_queue);
+
+	mutex_init(&buf->produce_lock);
+	mutex_init(&buf->consume_lock);
+	init_rwsem(&buf->heap_sem);
+	spin_lock_init(&buf->stamp_lock);
+	hrtimer_setup(&buf->coalesce_timer, buffer_coalesce_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+
+	buf->size = size;
+
+ out:
+	return buf;
+}
+
+static void buffer_free(struct buffer *buffer)
+{
+	hrtimer_cancel(&buffer->coalesce_timer);
+	kvfree(buffer->carry);
+	kvfree(buffer->heap);
+	kvfree(buffer->lazy_next);
+	if (buffer->spill)
+		fput(buffer->spill);
+	kfree(buffer);
+}
+
+static inline bool buffer_try_produce(struct buffer *buf, unsigned long *seq)
+{
+	unsigned long cur = READ_ONCE(buf->seq);
+
+	if (cur & 1)
+		return false;
+
+	/* Fully ordered: no data store can be observed before the odd seq */
+	if (cmpxchg(&buf->seq, cur, cur + 1) != cur)
+		return false;
+
+	*seq = cur + 1;
+	return true;
+}
+
+static inline bool buffer_try_consume(struct buffer *buf)
+{
+	return !test_and_set_bit_lock(0, &buf->reading);
+}
+
+/*
+ * Slow paths for the (rare) case when several tasks write to or read from
+ * the same fd at once: the losers queue up on the mutex of their side, and
+ * the one at the head waits for the role to be released.
+ */
+static int buffer_produce_slow(struct buffer *buf, unsigned long *seq)
+{
+	int err;
+
+	if (mutex_lock_interruptible(&buf->produce_lock))
+		return -ERESTARTSYS;
+
+	err = wait_event_interruptible(buf->role_queue,
+				       buffer_try_produce(buf, seq));
+
+	mutex_unlock(&buf->produce_lock);
+	return err;
+}
+
+static int buffer_consume_slow(struct buffer *buf)
+{
+	int err;
+
+	if (mutex_lock_interruptible(&buf->consume_lock))
+		return -ERESTARTSYS;
+
+	err = wait_event_interruptible(buf->role_queue,
+				       buffer_try_consume(buf));
+
+	mutex_unlock(&buf->consume_lock);
+	return err;
+}
+
+static inline int buffer_produce(struct buffer *buf, unsigned long *seq)
+{
+	if (likely(buffer_try_produce(buf, seq)))
+		return 0;
+
+	return buffer_produce_slow(buf, seq);
+}
+
+static inline int buffer_consume(struct buffer *buf)
+{
+	if (likely(buffer_try_consume(buf)))
+		return 0;
+
+	return buffer_consume_slow(buf);
+}
+
+/* Wake the readers up for the messages published so far, if any */
+static void buffer_coalesce_flush(struct buffer *buf)
+{
+	int n = atomic_xchg(&buf->coalesce_pending, 0);
+
+	if (!n)
+		return;
+
+	reverse_stat_inc(STAT_WAKEUP_BATCH_1 +
+			 min(ilog2(n), STAT_WAKEUP_BATCH_128 - STAT_WAKEUP_BATCH_1));
+	wake_up_interruptible(&buf->read_queue);
+}
+
+static enum hrtimer_restart buffer_coalesce_timer(struct hrtimer *timer)
+{
+	buffer_coalesce_flush(container_of(timer, struct buffer,
+					   coalesce_timer));
+
+	return HRTIMER_NORESTART;
+}
+
+/* Count a message towards the batch, the first one starts the clock */
+static void buffer_coalesce(struct buffer *buf, unsigned int batch)
+{
+	int n = atomic_inc_return(&buf->coalesce_pending);
+
+	if (n >= batch) {
+		hrtimer_try_to_cancel(&buf->coalesce_timer);
+		buffer_coalesce_flush(buf);
+	} else if (n == 1) {
+		hrtimer_start(&buf->coalesce_timer,
+			      us_to_ktime(READ_ONCE(buf->coalesce_delay)),
+			      HRTIMER_MODE_REL);
+	}
+}
+
+/*
+ * Make the message written under @seq visible to the consumer and wake up
+ * whoever is waiting for it.
+ */
+static inline void buffer_publish(struct buffer *buf, unsigned long seq)
+{
+	unsigned int batch = READ_ONCE(buf->coalesce_batch);
+
+	smp_store_release(&buf->seq, seq + 1);
+
+	/* Pairs with the barrier in prepare_to_wait() */
+	smp_mb();
+	if (batch > 1)
+		buffer_coalesce(buf, batch);
+	else if (waitqueue_active(&buf->read_queue))
+		wake_up_interruptible(&buf->read_queue);
+	if (waitqueue_active(&buf->role_queue))
+		wake_up(&buf->role_queue);
+}
+
+/*
+ * Give the producer role up without publishing anything. The old message
+ * is valid again, so readers that found it being replaced go on with it.
+ */
+static inline void buffer_yield(struct buffer *buf, unsigned long seq)
+{
+	smp_store_release(&buf->seq, seq - 1);
+
+	smp_mb();
+	if (waitqueue_active(&buf->read_queue))
+		wake_up_interruptible(&buf->read_queue);
+	if (waitqueue_active(&buf->role_queue))
+		wake_up(&buf->role_queue);
+}
+
+static inline void buffer_release_consumer(struct buffer *buf)
+{
+	clear_bit_unlock(0, &buf->reading);
+
+	smp_mb__after_atomic();
+	if (waitqueue_active(&buf->role_queue))
+		wake_up(&buf->role_queue);
+}
+
+/* Majority vote over the nodes a side of the buffer runs on */
+static inline void numa_vote(struct numa_vote *vote, int node)
+{
+	if (vote->node == node) {
+		if (vote->votes < NUMA_MIGRATE_VOTES)
+			vote->votes++;
+	} else if (vote->votes) {
+		vote->votes--;
+	} else {
+		vote->node = node;
+		vote->votes = 1;
+	}
+}
+
+/* Called by the producer or the consumer with its own @vote */
+static inline void buffer_note_access(struct buffer *buf,
+				      struct numa_vote *vote)
+{
+	int node = numa_node_id();
+
+	if (node == buf->node)
+		reverse_stat_inc(STAT_NUMA_LOCAL);
+	else
+		reverse_stat_inc(STAT_NUMA_REMOTE);
+
+	if (unlikely(READ_ONCE(numa_migrate)))
+		numa_vote(vote, node);
+}
+
+/*
+ * Whether the message lives in @small rather than in @heap. Inline messages
+ * always start at @small; a range check would also match a heap that
+ * happens to start right after the struct.
+ */
+static inline bool buffer_inline(const struct buffer *buf)
+{
+	return buf->data == buf->small;
+}
+
+/* Both halves of the lazy index of a @size byte buffer in one go */
+static u32 *lazy_index_alloc(unsigned long size, int node)
+{
+	return kvmalloc_node(array_size(2 * sizeof(u32),
+					DIV_ROUND_UP(size, LAZY_BLOCK)),
+			     GFP_KERNEL, node);
+}
+
+/*
+ * Reallocate @heap, @carry and the lazy index for @size bytes on @node,
+ * keeping what they hold; the caller makes sure it fits. Both roles have
+ * to be held.
+ */
+static int buffer_realloc(struct buffer *buf, unsigned long size, int node)
+{
+	size_t nblocks = DIV_ROUND_UP(size, LAZY_BLOCK);
+	size_t old_nblocks = DIV_ROUND_UP(buf->size, LAZY_BLOCK), len;
+	char *heap = NULL, *carry = NULL, *dst;
+	u32 *index = NULL;
+
+	if (buf->heap) {
+		heap = kvmalloc_node(size, GFP_KERNEL, node);
+		if (!heap)
+			goto out_nomem;
+	}
+	if (buf->carry) {
+		carry = kvmalloc_node(size, GFP_KERNEL, node);
+		if (!carry)
+			goto out_nomem;
+	}
+	if (buf->lazy_next) {
+		index = lazy_index_alloc(size, node);
+		if (!index)
+			goto out_nomem;
+	}
+
+	if (carry) {
+		memcpy(carry, buf->carry, buf->carry_len);
+		kvfree(buf->carry);
+		buf->carry = carry;
+	}
+	if (heap) {
+		if (!buffer_inline(buf)) {
+			/* Append mode keeps the message at the end of the heap */
+			len = buf->end - buf->data;
+			dst = buf->mode & REVERSE_MODE_APPEND ?
+			    heap + size - len : heap;
+			memcpy(dst, buf->data, len);
+			buf->data = dst;
+			buf->end = dst + len;
+		}
+		kvfree(buf->heap);
+		buf->heap = heap;
+	}
+	if (index) {
+		/* The message fits, and so does its part of the index */
+		memcpy(index, buf->lazy_next,
+		       min(nblocks, old_nblocks) * sizeof(u32));
+		memcpy(index + nblocks, buf->lazy_prev,
+		       min(nblocks, old_nblocks) * sizeof(u32));
+		kvfree(buf->lazy_next);
+		buf->lazy_next = index;
+		buf->lazy_prev = index + nblocks;
+	}
+
+	buf->node = node;
+	WRITE_ONCE(buf->size, size);
+
+	return 0;
+
+ out_nomem:
+	kvfree(carry);
+	kvfree(heap);
+	return -ENOMEM;
+}
+
+/* The vote that calls for a migration, if any. Called by the producer. */
+static struct numa_vote *buffer_migrate_vote(struct buffer *buf)
+{
+	struct numa_vote *vote;
+
+	vote = buf->write_vote.votes >= READ_ONCE(buf->read_vote.votes) ?
+	    &buf->write_vote : &buf->read_vote;
+	if (READ_ONCE(vote->node) == buf->node ||
+	    READ_ONCE(vote->votes) < NUMA_MIGRATE_VOTES)
+		return NULL;
+
+	return vote;
+}
+
+/*
+ * Move @heap and @carry to the node that has won the vote, if any. Called
+ * by the producer between messages. The struct buffer itself stays where
+ * it is, as file->private_data can't be changed under other users of the
+ * fd, but it is mostly the payload that gets touched.
+ */
+static void buffer_migrate(struct buffer *buf)
+{
+	struct numa_vote *vote;
+	int err;
+
+	/* Most writes stop here, without disturbing the reader */
+	if (!buffer_migrate_vote(buf))
+		return;
+
+	/* The reader might be copying out of the heap */
+	if (!buffer_try_consume(buf))
+		return;
+
+	/* The reader's vote may have changed meanwhile */
+	vote = buffer_migrate_vote(buf);
+	if (!vote)
+		goto out;
+
+	if (!down_write_trylock(&buf->heap_sem))
+		goto out;
+	err = buffer_realloc(buf, buf->size, vote->node);
+	up_write(&buf->heap_sem);
+	if (err)
+		goto out;
+
+	buf->write_vote.votes = buf->read_vote.votes = 0;
+	reverse_stat_inc(STAT_NUMA_MIGRATIONS);
+ out:
+	buffer_release_consumer(buf);
+}
+
+/*
+ * Change the capacity of @buf. The message being read and an incomplete
+ * record are kept; if they don't fit, the buffer is busy.
+ */
+static int buffer_resize(struct buffer *buf, unsigned long size)
+{
+	unsigned long seq;
+	int err;
+
+	/* Waits for the job in flight, if any */
+	err = buffer_produce(buf, &seq);
+	if (err)
+		return err;
+
+	err = buffer_consume(buf);
+	if (err)
+		goto out_yield;
+
+	if (buf->lazy_next && size > U32_MAX)
+		err = -EINVAL;
+	/* Not even a length prefix would fit */
+	else if (buf->framing == REVERSE_FRAME_LENGTH && size < sizeof(u32))
+		err = -EINVAL;
+	else if (buf->end - buf->data > size || buf->carry_len > size)
+		err = -EBUSY;
+	else {
+		down_write(&buf->heap_sem);
+		err = buffer_realloc(buf, size, buf->node);
+		up_write(&buf->heap_sem);
+	}
+
+	buffer_release_consumer(buf);
+ out_yield:
+	buffer_yield(buf, seq);
+	return err;
+}
+
+/* A stamp for a message written at @write, none if that one wasn't */
+static inline u64 buffer_clock(u64 write)
+{
+	return write ? ktime_get_ns() : 0;
+}
+
+/* Stamp a message before publishing it. Called by the producer. */
+static inline void buffer_stamp(struct buffer *buf, u64 write, u64 start)
+{
+	buf->stamp_write = write;
+	buf->stamp_start = start;
+	buf->stamp_end = buffer_clock(write);
+}
+
+/* Note the first read of the message published as @seq */
+static void buffer_stamp_read(struct buffer *buf, unsigned long seq)
+{
+	if (READ_ONCE(buf->stamp_read_seq) == seq)
+		return;
+
+	spin_lock(&buf->stamp_lock);
+	if (buf->stamp_read_seq != seq) {
+		buf->stamp_read = ktime_get_ns();
+		WRITE_ONCE(buf->stamp_read_seq, seq);
+	}
+	spin_unlock(&buf->stamp_lock);
+}
+
+/* What readers need to know about the message published as some @seq */
+struct buffer_view {
+	char *data;
+	size_t len;
+	bool lazy;
+	bool spilled;
+};
+
+/*
+ * Take a consistent view of the message published as @seq, or fail with
+ * -EAGAIN if it is being replaced. The message itself may still be
+ * overwritten while it is copied out, so readers check @seq again after.
+ */
+static int buffer_view(struct buffer *buf, unsigned long seq,
+		       struct buffer_view *view)
+{
+	size_t spill_len;
+
+	view->data = READ_ONCE(buf->data);
+	view->len = READ_ONCE(buf->end) - view->data;
+	view->lazy = READ_ONCE(buf->lazy);
+	spill_len = READ_ONCE(buf->spill_len);
+
+	smp_rmb();
+	if (READ_ONCE(buf->seq) != seq)
+		return -EAGAIN;
+
+	view->spilled = spill_len != 0;
+	if (view->spilled)
+		view->len = spill_len;
+
+	return 0;
+}
+
+/* Called by the consumer only */
+static bool buffer_readable(struct buffer *buf)
+{
+	unsigned long seq = smp_load_acquire(&buf->seq);
+	struct buffer_view view;
+
+	if (seq & 1)
+		return false;
+
+	return seq != buf->read_seq || buffer_view(buf, seq, &view) ||
+	    buf->read_pos < view.len;
+}
+
+/*
+ * Spin for up to @usecs waiting for data, like net's busy_poll does for
+ * sockets: when the producer is about to answer, this is a lot cheaper
+ * than going to sleep and being woken up again.
+ */
+static bool buffer_busy_poll(struct buffer *buf, unsigned int usecs)
+{
+	u64 end = local_clock() + (u64)usecs * NSEC_PER_USEC;
+
+	do {
+		if (buffer_readable(buf))
+			return true;
+		cpu_relax();
+	} while (!need_resched() && !signal_pending(current) &&
+		 local_clock() < end);
+
+	return buffer_readable(buf);
+}
+
+/* Set by the benchmark if reverse_swab() is the faster one here */
+DEFINE_STATIC_KEY_FALSE(reverse_word_swab);
+
+static inline char *reverse_word(char *start, char *end)
+{
+	if (static_branch_unlikely(&reverse_word_swab) && end - start >= 15)
+		reverse_swab(start, end);
+	else
+		reverse_bytes(start, end);
+
+	return start;
+}
+
+/*
+ * Reverse the order of the words in [start, end]. Delimiters are found
+ * DELIM_SCAN_BYTES at a time, and every word is reversed as soon as the
+ * mask says where it ends; reversing the whole phrase afterwards puts the
+ * letters of each word back into their original order.
+ */
+static char *reverse_phrase(char *start, char *end,
+			    const struct delim_set *set)
+{
+	char *word_start = start, *p = start;
+	size_t left = end - start + 1, chunk;
+	u32 mask;
+
+	while (left) {
+		mask = delim_scan_chunk(set, p, left, &chunk);
+
+		for (; mask; mask &= mask - 1) {
+			char *word_end = p + __ffs(mask);
+
+			/* Don't tear a delimiter away from its combining marks */
+			if (unlikely(set->utf8 == REVERSE_UTF8_GRAPHEME) &&
+			    utf8_extends(word_end + 1, end - word_end))
+				continue;
+
+			reverse_word(word_start, word_end - 1);
+			word_start = word_end + 1;
+		}
+
+		p += chunk;
+		left -= chunk;
+	}
+
+	reverse_word(word_start, end);
+
+	return reverse_word(start, end);
+}
+
+/*
+ * A version of reverse_phrase() that can be stopped and resumed, for work
+ * done in time slices. Like span_reverse_phrase(), it reverses the whole
+ * phrase first and the words afterwards. Does about @budget bytes worth of
+ * work per call and returns true once the phrase is done. Doesn't know
+ * about grapheme clusters.
+ *
+ * Every word is in its final place as soon as it is reversed, so with
+ * @st->crc set, the output goes into the CRC a chunk at a time while it
+ * is still in the cache.
+ */
+static bool reverse_phrase_step(char *data, size_t len,
+				const struct delim_set *set,
+				struct reverse_state *st, size_t budget)
+{
+	size_t n, chunk;
+	u32 mask;
+
+	if (!st->words) {
+		n = min(budget, len / 2 - st->pos);
+		for (; n; n--, st->pos++)
+			swap(data[st->pos], data[len - 1 - st->pos]);
+		if (st->pos < len / 2)
+			return false;
+
+		st->words = true;
+		st->pos = 0;
+		return false;
+	}
+
+	while (budget && st->pos < len) {
+		mask = delim_scan_chunk(set, data + st->pos, len - st->pos,
+					&chunk);
+
+		for (; mask; mask &= mask - 1) {
+			n = st->pos + __ffs(mask);
+			reverse_word(data + st->word_start, data + n - 1);
+			st->word_start = n + 1;
+		}
+
+		st->pos += chunk;
+		budget -= min(budget, chunk);
+
+		if (st->crc) {
+			*st->crc = crc32c(*st->crc, data + st->crc_pos,
+					  st->word_start - st->crc_pos);
+			st->crc_pos = st->word_start;
+		}
+	}
+
+	if (st->pos < len)
+		return false;
+
+	reverse_word(data + st->word_start, data + len - 1);
+	if (st->crc)
+		*st->crc = crc32c(*st->crc, data + st->crc_pos,
+				  len - st->crc_pos);
+	return true;
+}
+
+/*
+ * reverse_phrase() the @len bytes at @data, computing a CRC32C of the
+ * output into @crc in the same pass if it is set.
+ */
+static void reverse_phrase_crc(char *data, size_t len,
+			       const struct delim_set *set, u32 *crc)
+{
+	struct reverse_state st = { .crc = crc };
+
+	if (!crc) {
+		reverse_phrase(data, data + len - 1, set);
+		return;
+	}
+
+	/* reverse_phrase_step() can't do those */
+	if (set->utf8 == REVERSE_UTF8_GRAPHEME) {
+		reverse_phrase(data, data + len - 1, set);
+		*crc = crc32c(*crc, data, len);
+		return;
+	}
+
+	while (!reverse_phrase_step(data, len, set, &st, SIZE_MAX))
+		;
+}
+
+/*
+ * Lazy mode. Reversing the word order maps output byte p of an n byte
+ * message to input byte j = n - 1 - p when that is a delimiter, and to
+ * byte s + e - 1 - j when j lies in the word [s, e). A word thus comes out
+ * as one plain copy, and all it takes to produce any range of the output
+ * is finding the words around it. The index makes that O(LAZY_BLOCK): for
+ * every block of the input, @lazy_next has the first delimiter at or after
+ * its start (n for none), and @lazy_prev the last delimiter before its end
+ * plus one (0 for none).
+ */
+static inline bool lazy_delim(const struct delim_set *set, const char *in,
+			      size_t n, size_t j)
+{
+	if (!delim_test(set, in[j]))
+		return false;
+
+	/* Same as in reverse_phrase() */
+	return set->utf8 != REVERSE_UTF8_GRAPHEME ||
+	    !utf8_extends(in + j + 1, n - 1 - j);
+}
+
+/* Index the @n byte message in @buf->data. Called by the producer. */
+static void lazy_index(struct buffer *buf, size_t n)
+{
+	const struct delim_set *set = &buf->lazy_delims;
+	size_t nblocks = DIV_ROUND_UP(n, LAZY_BLOCK), b, pos, chunk, j;
+	const char *in = buf->data;
+	u32 first, last, mask;
+
+	for (b = 0; b < nblocks; b++) {
+		first = last = 0;
+		for (pos = b * LAZY_BLOCK; pos < min(n, (b + 1) * LAZY_BLOCK);
+		     pos += chunk) {
+			mask = delim_scan_chunk(set, in + pos, n - pos, &chunk);
+
+			for (; mask; mask &= mask - 1) {
+				j = pos + __ffs(mask);
+				if (!lazy_delim(set, in, n, j))
+					continue;
+				if (!first)
+					first = j + 1;
+				last = j + 1;
+			}
+		}
+		buf->lazy_next[b] = first;
+		buf->lazy_prev[b] = last;
+	}
+
+	/* Carry the nearest delimiters over to the blocks that have none */
+	for (b = nblocks, first = n; b--;) {
+		if (buf->lazy_next[b])
+			first = buf->lazy_next[b] - 1;
+		buf->lazy_next[b] = first;
+	}
+	for (b = 0, last = 0; b < nblocks; b++) {
+		if (buf->lazy_prev[b])
+			last = buf->lazy_prev[b];
+		buf->lazy_prev[b] = last;
+	}
+}
+
+/*
+ * Produce @len bytes of the output of the @n byte lazy message at @in,
+ * starting from position @pos. The message may be replaced meanwhile, so
+ * everything read from the index is checked and -EAGAIN means the result
+ * is torn.
+ */
+static int lazy_fill(const struct buffer *buf, const char *in, size_t n,
+		     size_t pos, char *out, size_t len)
+{
+	const struct delim_set *set = &buf->lazy_delims;
+	size_t j, s, e, k, b, cnt;
+
+	if (pos + len > n)
+		return -EAGAIN;
+
+	while (len) {
+		j = n - 1 - pos;
+		if (lazy_delim(set, in, n, j)) {
+			*out++ = in[j];
+			pos++;
+			len--;
+			continue;
+		}
+
+		b = j / LAZY_BLOCK;
+		for (e = j + 1; e < min(n, (b + 1) * LAZY_BLOCK) &&
+		     !lazy_delim(set, in, n, e); e++)
+			;
+		if (e == (b + 1) * LAZY_BLOCK && e < n)
+			e = READ_ONCE(buf->lazy_next[b + 1]);
+
+		for (s = j; s > b * LAZY_BLOCK && !lazy_delim(set, in, n, s - 1);
+		     s--)
+			;
+		if (s == b * LAZY_BLOCK && s)
+			s = READ_ONCE(buf->lazy_prev[b - 1]);
+
+		if (s > j || e <= j || e > n)
+			return -EAGAIN;
+
+		k = e - 1 - j;
+		cnt = min(len, e - s - k);
+		memcpy(out, in + s + k, cnt);
+		out += cnt;
+		pos += cnt;
+		len -= cnt;
+	}
+
+	return 0;
+}
+
+/* copy_to_user() from position @pos of the output of a lazy message */
+static int lazy_copy_to_user(const struct buffer *buf, char __user *out,
+			     const char *in, size_t n, size_t pos, size_t len)
+{
+	char chunk[LAZY_CHUNK];
+	size_t cnt;
+	int err;
+
+	/* A torn @in and @n could point anywhere */
+	if (n > (in == buf->small ? BUFFER_INLINE_SIZE : READ_ONCE(buf->size)))
+		return -EAGAIN;
+
+	while (len) {
+		cnt = min(len, sizeof(chunk));
+		err = lazy_fill(buf, in, n, pos, chunk, cnt);
+		if (err)
+			return err;
+		if (copy_to_user(out, chunk, cnt))
+			return -EFAULT;
+		out += cnt;
+		pos += cnt;
+		len -= cnt;
+	}
+
+	return 0;
+}
+
+/*
+ * Spans are payloads that aren't contiguous in kernel memory, such as
+ * pinned user pages. They are accessed one segment at a time; a segment
+ * never crosses a page boundary, so it can always be reached with
+ * kmap_local_page(). The ->get() method looks up the segment holding the
+ * given position of the payload, ->put() (if any) releases it.
+ */
+struct seg {
+	struct page *page;
+	unsigned int off;	/* where the segment starts within the page */
+	unsigned int len;
+	size_t start;		/* where the segment starts within the payload */
+};
+
+struct span {
+	size_t len;
+	int (*get)(struct span *span, size_t pos, struct seg *seg);
+	void (*put)(struct span *span, struct seg *seg);
+};
+
+static inline void span_put(struct span *span, struct seg *seg)
+{
+	if (span->put)
+		span->put(span, seg);
+}
+
+/* Reverse the bytes in [lo, hi) of @span */
+static int span_reverse(struct span *span, size_t lo, size_t hi)
+{
+	struct seg front, back;
+	char *head, *tail, tmp;
+	size_t n, i;
+	int err;
+
+	while (hi - lo > 1) {
+		err = span->get(span, lo, &front);
+		if (err)
+			return err;
+		err = span->get(span, hi - 1, &back);
+		if (err) {
+			span_put(span, &front);
+			return err;
+		}
+
+		n = min3(front.start + front.len - lo, hi - back.start,
+			 (hi - lo) / 2);
+
+		head = kmap_local_page(front.page) + front.off +
+		    (lo - front.start);
+		tail = kmap_local_page(back.page) + back.off +
+		    (hi - 1 - back.start);
+
+		for (i = 0; i < n; i++) {
+			tmp = head[i];
+			head[i] = *(tail - i);
+			*(tail - i) = tmp;
+		}
+
+		kunmap_local(tail);
+		kunmap_local(head);
+		span_put(span, &back);
+		span_put(span, &front);
+
+		lo += n;
+		hi -= n;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * The span version of reverse_phrase(). The whole payload is reversed
+ * first and the words are put back in order afterwards, which gives the
+ * same result and lets the delimiter scan run forward, one segment at a
+ * time.
+ */
+static int span_reverse_phrase(struct span *span, const struct delim_set *set)
+{
+	size_t pos = 0, word_start = 0, i, chunk, word_end;
+	struct seg seg;
+	char *p;
+	u32 mask;
+	int err;
+
+	err = span_reverse(span, 0, span->len);
+
+	while (!err && pos < span->len) {
+		err = span->get(span, pos, &seg);
+		if (err)
+			break;
+
+		p = kmap_local_page(seg.page) + seg.off;
+		for (i = 0; !err && i < seg.len; i += chunk) {
+			mask = delim_scan_chunk(set, p + i, seg.len - i, &chunk);
+
+			for (; !err && mask; mask &= mask - 1) {
+				word_end = seg.start + i + __ffs(mask);
+				err = span_reverse(span, word_start, word_end);
+				word_start = word_end + 1;
+			}
+		}
+		kunmap_local(p);
+		span_put(span, &seg);
+
+		pos = seg.start + seg.len;
+	}
+
+	return err ? err : span_reverse(span, word_start, span->len);
+}
+
+/* A span over an array of pages, such as pinned user memory */
+struct page_span {
+	struct span span;
+	struct page **pages;
+	unsigned int offset;	/* where the payload starts in pages[0] */
+};
+
+static int page_span_get(struct span *span, size_t pos, struct seg *seg)
+{
+	struct page_span *ps = container_of(span, struct page_span, span);
+	size_t abs = ps->offset + pos, page_start = abs & PAGE_MASK;
+	size_t start = max_t(size_t, page_start, ps->offset);
+	size_t end = min_t(size_t, page_start + PAGE_SIZE,
+			   ps->offset + span->len);
+
+	seg->page = ps->pages[abs >> PAGE_SHIFT];
+	seg->off = start - page_start;
+	seg->len = end - start;
+	seg->start = start - ps->offset;
+
+	return 0;
+}
+
+/*
+ * A span over a scatterlist. Entries may cross page boundaries, so they
+ * are cut up into page sized segments up front and looked up by bisection.
+ */
+struct sg_span {
+	struct span span;
+	struct seg *segs;
+	unsigned int nr_segs;
+};
+
+static int sg_span_get(struct span *span, size_t pos, struct seg *seg)
+{
+	struct sg_span *ss = container_of(span, struct sg_span, span);
+	unsigned int lo = 0, hi = ss->nr_segs, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (ss->segs[mid].start <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	*seg = ss->segs[lo];
+	return 0;
+}
+
+static int sg_span_init(struct sg_span *ss, struct scatterlist *sgl,
+			unsigned int nents, size_t len)
+{
+	struct scatterlist *sg;
+	size_t offset, chunk, pos = 0;
+	unsigned int i, n = 0;
+
+	for_each_sg(sgl, sg, nents, i)
+		n += DIV_ROUND_UP(offset_in_page(sg->offset) + sg->length,
+				  PAGE_SIZE);
+
+	ss->segs = kvmalloc_array(n, sizeof(*ss->segs), GFP_KERNEL);
+	if (!ss->segs)
+		return -ENOMEM;
+
+	n = 0;
+	for_each_sg(sgl, sg, nents, i) {
+		for (offset = sg->offset;
+		     pos < len && offset < sg->offset + sg->length;
+		     offset += chunk) {
+			chunk = min3(PAGE_SIZE - offset_in_page(offset),
+				     sg->offset + sg->length - offset,
+				     len - pos);
+			ss->segs[n].page = sg_page(sg) + (offset >> PAGE_SHIFT);
+			ss->segs[n].off = offset_in_page(offset);
+			ss->segs[n].len = chunk;
+			ss->segs[n].start = pos;
+			pos += chunk;
+			n++;
+		}
+	}
+
+	if (pos < len) {
+		kvfree(ss->segs);
+		return -EINVAL;
+	}
+
+	ss->span.len = len;
+	ss->span.get = sg_span_get;
+	ss->span.put = NULL;
+	ss->nr_segs = n;
+
+	return 0;
+}
+
+/* Reverse a phrase in the caller's memory without copying it anywhere */
+static long reverse_user_region(const struct delim_set *set,
+				const struct reverse_region *region)
+{
+	unsigned long addr = region->addr, nr_pages;
+	struct page_span ps = { };
+	long pinned, result = 0;
+
+	if (!region->len)
+		return 0;
+	if (region->addr != addr || region->len != (size_t)region->len ||
+	    addr + region->len < addr)
+		return -EINVAL;
+
+	nr_pages = DIV_ROUND_UP(offset_in_page(addr) + region->len, PAGE_SIZE);
+	ps.pages = kvmalloc_array(nr_pages, sizeof(*ps.pages), GFP_KERNEL);
+	if (!ps.pages)
+		return -ENOMEM;
+
+	pinned = pin_user_pages_fast(addr & PAGE_MASK, nr_pages, FOLL_WRITE,
+				     ps.pages);
+	if (pinned < 0) {
+		result = pinned;
+		goto out_free;
+	}
+	if (pinned < nr_pages) {
+		result = -EFAULT;
+		goto out_unpin;
+	}
+
+	ps.span.len = region->len;
+	ps.span.get = page_span_get;
+	ps.offset = offset_in_page(addr);
+
+	result = span_reverse_phrase(&ps.span, set);
+
+ out_unpin:
+	unpin_user_pages_dirty_lock(ps.pages, pinned, pinned == nr_pages);
+ out_free:
+	kvfree(ps.pages);
+	return result;
+}
+
+/*
+ * A span over a shmem file, for spilled messages. The pages are looked up
+ * (and swapped in, if need be) as they are reached, and each one is
+ * released as soon as it is done with.
+ */
+struct spill_span {
+	struct span span;
+	struct address_space *mapping;
+};
+
+static int spill_span_get(struct span *span, size_t pos, struct seg *seg)
+{
+	struct spill_span *ss = container_of(span, struct spill_span, span);
+	pgoff_t index = pos >> PAGE_SHIFT;
+	struct folio *folio;
+
+	folio = shmem_read_folio(ss->mapping, index);
+	if (IS_ERR(folio))
+		return PTR_ERR(folio);
+
+	seg->page = folio_file_page(folio, index);
+	seg->off = 0;
+	seg->start = pos & PAGE_MASK;
+	seg->len = min_t(size_t, PAGE_SIZE, span->len - seg->start);
+
+	return 0;
+}
+
+static void spill_span_put(struct span *span, struct seg *seg)
+{
+	struct folio *folio = page_folio(seg->page);
+
+	folio_mark_dirty(folio);
+	folio_put(folio);
+}
+
+static void spill_span_init(struct spill_span *ss, struct file *spill,
+			    size_t len)
+{
+	ss->span.len = len;
+	ss->span.get = spill_span_get;
+	ss->span.put = spill_span_put;
+	ss->mapping = spill->f_mapping;
+}
+
+/* Drop the spilled message, if any. Called by the producer. */
+static void buffer_unspill(struct buffer *buf)
+{
+	struct file *spill = buf->spill;
+
+	buf->spill_len = 0;
+	if (!spill)
+		return;
+
+	/* Wait for the readers still copying out of it */
+	down_write(&buf->heap_sem);
+	buf->spill = NULL;
+	up_write(&buf->heap_sem);
+
+	fput(spill);
+}
+
+/*
+ * Make the @len bytes of user data the new message, kept in a shmem file
+ * of its own. It is filled a page at a time, so the pages written so far
+ * can be swapped out while the rest is copied in. Nothing changes if this
+ * fails. Called by the producer.
+ */
+static int buffer_spill(struct buffer *buf, const char __user *in,
+			size_t len)
+{
+	struct spill_span ss;
+	struct file *spill;
+	struct seg seg;
+	size_t pos;
+	char *p;
+	int err = 0;
+
+	spill = shmem_file_setup("reverse", len, VM_NORESERVE);
+	if (IS_ERR(spill))
+		return PTR_ERR(spill);
+
+	spill_span_init(&ss, spill, len);
+	for (pos = 0; pos < len; pos += seg.len) {
+		err = spill_span_get(&ss.span, pos, &seg);
+		if (err)
+			break;
+
+		p = kmap_local_page(seg.page);
+		if (copy_from_user(p, in + pos, seg.len))
+			err = -EFAULT;
+		kunmap_local(p);
+		spill_span_put(&ss.span, &seg);
+
+		if (err)
+			break;
+		cond_resched();
+	}
+
+	if (err) {
+		fput(spill);
+		return err;
+	}
+
+	buffer_unspill(buf);
+	buf->data = buf->end = buf->small;
+	buf->lazy = false;
+	buf->spill = spill;
+	buf->spill_len = len;
+
+	reverse_stat_inc(STAT_SPILLS);
+	return 0;
+}
+
+/* Reverse the spilled message in place, page by page */
+static int buffer_spill_reverse(struct buffer *buf)
+{
+	struct spill_span ss;
+	struct seg seg;
+	size_t pos;
+	char *p;
+	int err;
+
+	spill_span_init(&ss, buf->spill, buf->spill_len);
+
+	err = span_reverse_phrase(&ss.span, &buf->delims);
+	if (err || !(buf->mode & REVERSE_MODE_CRC))
+		return err;
+
+	/* The pages may well be gone by now, so this one isn't fused */
+	for (pos = 0; pos < ss.span.len; pos += seg.len) {
+		err = spill_span_get(&ss.span, pos, &seg);
+		if (err)
+			return err;
+
+		p = kmap_local_page(seg.page);
+		buf->crc = crc32c(buf->crc, p, seg.len);
+		kunmap_local(p);
+		spill_span_put(&ss.span, &seg);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Copy @len bytes of the spilled message from @pos on. The caller holds
+ * @heap_sem for reading and has found the message spilled; if it has been
+ * replaced since, this fails with -EAGAIN.
+ */
+static int spill_copy_to_user(struct buffer *buf, char __user *out,
+			      size_t pos, size_t len)
+{
+	struct file *spill = READ_ONCE(buf->spill);
+	struct folio *folio;
+	size_t chunk;
+	char *p;
+	int err;
+
+	if (!spill || pos + len > i_size_read(file_inode(spill)))
+		return -EAGAIN;
+
+	for (; len; pos += chunk, out += chunk, len -= chunk) {
+		folio = shmem_read_folio(spill->f_mapping, pos >> PAGE_SHIFT);
+		if (IS_ERR(folio))
+			return PTR_ERR(folio);
+
+		chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(pos));
+		p = kmap_local_folio(folio, offset_in_folio(folio, pos));
+		err = copy_to_user(out, p, chunk) ? -EFAULT : 0;
+		kunmap_local(p);
+		folio_put(folio);
+
+		if (err)
+			return err;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Hand out the current result as a sealed, read-only shmem file. A spilled
+ * result is one already, anything else is copied into a new file first.
+ * Called by the producer, so the result is complete and stays as it is.
+ */
+static struct file *buffer_export(struct buffer *buf, size_t *len)
+{
+	struct shmem_inode_info *info;
+	struct spill_span ss;
+	struct file *file, *export;
+	struct seg seg;
+	size_t n, pos;
+	char *p;
+	int err = 0;
+
+	if (buf->spill_len) {
+		n = buf->spill_len;
+		file = get_file(buf->spill);
+	} else {
+		n = buf->end - buf->data;
+		file = shmem_file_setup("reverse", n, VM_NORESERVE);
+		if (IS_ERR(file))
+			return file;
+
+		spill_span_init(&ss, file, n);
+		for (pos = 0; pos < n; pos += seg.len) {
+			err = spill_span_get(&ss.span, pos, &seg);
+			if (err)
+				goto out_put;
+
+			p = kmap_local_page(seg.page);
+			if (buf->lazy)
+				err = lazy_fill(buf, buf->data, n, pos, p, seg.len);
+			else
+				memcpy(p, buf->data + pos, seg.len);
+			kunmap_local(p);
+			spill_span_put(&ss.span, &seg);
+
+			if (err)
+				goto out_put;
+			cond_resched();
+		}
+	}
+
+	/* Like F_ADD_SEALS would, nobody has the file mapped yet */
+	info = SHMEM_I(file_inode(file));
+	inode_lock(file_inode(file));
+	if (!(info->seals & F_SEAL_WRITE)) {
+		err = mapping_deny_writable(file->f_mapping);
+		if (!err)
+			info->seals |= F_SEAL_SEAL | F_SEAL_SHRINK |
+			    F_SEAL_GROW | F_SEAL_WRITE;
+	}
+	inode_unlock(file_inode(file));
+	if (err)
+		goto out_put;
+
+	export = dentry_open(&file->f_path, O_RDONLY | O_LARGEFILE,
+			     current_cred());
+	fput(file);
+	if (!IS_ERR(export))
+		*len = n;
+
+	return export;
+
+ out_put:
+	fput(file);
+	return ERR_PTR(err);
+}
+
+/*
+ * Copy @len bytes of the message in @view from @pos on, whatever form it
+ * is in. Spilled messages need @heap_sem held for reading.
+ */
+static int buffer_copy_to_user(struct buffer *buf, char __user *out,
+			       const struct buffer_view *view, size_t pos,
+			       size_t len)
+{
+	if (view->spilled)
+		return spill_copy_to_user(buf, out, pos, len);
+	if (view->lazy)
+		return lazy_copy_to_user(buf, out, view->data, view->len, pos,
+					 len);
+
+	return copy_to_user(out, view->data + pos, len) ? -EFAULT : 0;
+}
+
+/*
+ * Result cache: recently reversed payloads keyed by a hash of the input and
+ * its length. Entries keep the input next to the output, along with the
+ * delimiter set and UTF-8 mode it was reversed with, so a hash collision
+ * can never hand out somebody else's result. The total size of
+ * all entries is capped by cache_size and the least recently used ones are
+ * evicted first.
+ *
+ * Payloads may be large, so @cache_lock only covers the table and the LRU
+ * list: lookups take a reference on the entry and compare and copy the
+ * payload after dropping the lock. Entries that only collide in the hash
+ * are not cached side by side, the first one wins.
+ */
+#define CACHE_HASH_BITS	10
+
+struct cache_entry {
+	struct hlist_node node;
+	struct list_head lru;
+	struct kref ref;	/* the table holds one */
+	u64 hash;
+	/* What the output was computed with, the key alone may collide */
+	struct reverse_delims delims;
+	unsigned int utf8;
+	size_t len;
+	char data[];		/* input followed by output */
+};
+
+static DEFINE_HASHTABLE(cache_table, CACHE_HASH_BITS);
+static LIST_HEAD(cache_lru);
+static DEFINE_SPINLOCK(cache_lock);
+static size_t cache_bytes;
+static unsigned long cache_entries;
+
+static inline size_t cache_entry_size(size_t len)
+{
+	return sizeof(struct cache_entry) + 2 * len;
+}
+
+/* The entry for the input, or one that collides with it. Under @cache_lock. */
+static struct cache_entry *cache_find(size_t len, u64 hash,
+				      const struct delim_set *set)
+{
+	struct cache_entry *entry;
+
+	hash_for_each_possible(cache_table, entry, node, hash)
+		if (entry->hash == hash && entry->len == len &&
+		    entry->utf8 == set->utf8 &&
+		    !memcmp(&entry->delims, &set->delims, sizeof(set->delims)))
+			return entry;
+
+	return NULL;
+}
+
+static void cache_entry_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct cache_entry, ref));
+}
+
+static void cache_evict(struct cache_entry *entry)
+{
+	hash_del(&entry->node);
+	list_del(&entry->lru);
+	cache_bytes -= cache_entry_size(entry->len);
+	cache_entries--;
+	kref_put(&entry->ref, cache_entry_release);
+}
+
+/* On a hit, replaces @data with the cached output */
+static bool cache_lookup(char *data, size_t len, u64 hash,
+			 const struct delim_set *set)
+{
+	struct cache_entry *entry;
+	bool hit = false;
+
+	spin_lock(&cache_lock);
+	entry = cache_find(len, hash, set);
+	if (entry) {
+		kref_get(&entry->ref);
+		list_move(&entry->lru, &cache_lru);
+	}
+	spin_unlock(&cache_lock);
+
+	/* The entry is immutable once in the table, evicted or not */
+	if (entry) {
+		hit = !memcmp(entry->data, data, len);
+		if (hit)
+			memcpy(data, entry->data + len, len);
+		kref_put(&entry->ref, cache_entry_release);
+	}
+
+	if (hit)
+		reverse_stat_inc(STAT_CACHE_HITS);
+	else
+		reverse_stat_inc(STAT_CACHE_MISSES);
+
+	return hit;
+}
+
+static struct cache_entry *cache_entry_alloc(const char *in, size_t len,
+					     u64 hash,
+					     const struct delim_set *set)
+{
+	struct cache_entry *entry;
+
+	if (cache_entry_size(len) > READ_ONCE(cache_size))
+		return NULL;
+
+	entry = kmalloc(cache_entry_size(len), GFP_KERNEL | __GFP_NOWARN);
+	if (unlikely(!entry))
+		return NULL;
+
+	kref_init(&entry->ref);
+	entry->hash = hash;
+	entry->delims = set->delims;
+	entry->utf8 = set->utf8;
+	entry->len = len;
+	memcpy(entry->data, in, len);
+
+	return entry;
+}
+
+static void cache_insert(struct cache_entry *entry, const char *out,
+			 const struct delim_set *set)
+{
+	size_t size = cache_entry_size(entry->len);
+	struct cache_entry *victim;
+
+	memcpy(entry->data + entry->len, out, entry->len);
+
+	spin_lock(&cache_lock);
+
+	/* Somebody else has cached this input, or a colliding one, meanwhile */
+	if (cache_find(entry->len, entry->hash, set)) {
+		spin_unlock(&cache_lock);
+		kfree(entry);
+		return;
+	}
+
+	while (cache_bytes + size > READ_ONCE(cache_size) &&
+	       !list_empty(&cache_lru)) {
+		victim = list_last_entry(&cache_lru, struct cache_entry, lru);
+		cache_evict(victim);
+		reverse_stat_inc(STAT_CACHE_EVICTIONS);
+	}
+
+	hash_add(cache_table, &entry->node, entry->hash);
+	list_add(&entry->lru, &cache_lru);
+	cache_bytes += size;
+	cache_entries++;
+
+	spin_unlock(&cache_lock);
+}
+
+static void cache_flush(void)
+{
+	struct cache_entry *entry, *tmp;
+
+	spin_lock(&cache_lock);
+	list_for_each_entry_safe(entry, tmp, &cache_lru, lru)
+		cache_evict(entry);
+	spin_unlock(&cache_lock);
+}
+
+/*
+ * Reverse a freshly written message of @len bytes in place, serving it from
+ * the result cache when possible. With @crc set, a CRC32C of the output is
+ * added to it.
+ */
+void reverse_message_crc(char *data, size_t len, const struct delim_set *set,
+			 u32 *crc)
+{
+	struct cache_entry *entry;
+	u64 hash;
+
+	if (!len)
+		return;
+
+	/* Hashing and locking would cost more than reversing a small message */
+	if (len <= BUFFER_INLINE_SIZE || !READ_ONCE(cache_size)) {
+		reverse_phrase_crc(data, len, set, crc);
+		return;
+	}
+
+	hash = xxh64(data, len, set->key);
+	if (cache_lookup(data, len, hash, set)) {
+		if (crc)
+			*crc = crc32c(*crc, data, len);
+		return;
+	}
+
+	entry = cache_entry_alloc(data, len, hash, set);
+
+	reverse_phrase_crc(data, len, set, crc);
+
+	if (entry)
+		cache_insert(entry, data, set);
+}
+
+/* Add @len bytes of output at @p to the CRC, in REVERSE_MODE_CRC */
+static inline void buffer_crc(struct buffer *buf, const char *p, size_t len)
+{
+	if (buf->mode & REVERSE_MODE_CRC)
+		buf->crc = crc32c(buf->crc, p, len);
+}
+
+static int reverse_record(struct buffer *buf, char *data, size_t len)
+{
+	if (buf->delims.utf8 != REVERSE_UTF8_NONE && !utf8_valid(data, len))
+		return -EILSEQ;
+
+	reverse_message_crc(data, len, &buf->delims,
+			    buf->mode & REVERSE_MODE_CRC ? &buf->crc : NULL);
+
+	return 0;
+}
+
+/*
+ * Reverse the records among the first @len bytes of the message being
+ * written. An incomplete last record is moved to the carry buffer. Returns
+ * the number of bytes taken by complete records, or an error.
+ */
+static ssize_t reverse_frames(struct buffer *buf, size_t len)
+{
+	char *p = buf->data, *end = buf->data + len, *rec_end;
+	u32 rec_len;
+	int err;
+
+	switch (buf->framing) {
+	case REVERSE_FRAME_NONE:
+		err = reverse_record(buf, p, len);
+		return err ? err : len;
+
+	case REVERSE_FRAME_NEWLINE:
+		while ((rec_end = memchr(p, '\n', end - p)) != NULL) {
+			err = reverse_record(buf, p, rec_end - p);
+			if (err)
+				return err;
+			buffer_crc(buf, rec_end, 1);
+			p = rec_end + 1;
+		}
+
+		/* Not even its newline would fit behind it */
+		if (end - p >= buf->size)
+			return -EMSGSIZE;
+		break;
+
+	case REVERSE_FRAME_LENGTH:
+		while (end - p >= sizeof(rec_len)) {
+			rec_len = get_unaligned((u32 *) p);
+
+			/* It would never fit */
+			if (rec_len > buf->size - sizeof(rec_len))
+				return -EMSGSIZE;
+			if (rec_len > end - p - sizeof(rec_len))
+				break;
+
+			buffer_crc(buf, p, sizeof(rec_len));
+			err = reverse_record(buf, p + sizeof(rec_len), rec_len);
+			if (err)
+				return err;
+			p += sizeof(rec_len) + rec_len;
+		}
+		break;
+	}
+
+	buf->carry_len = end - p;
+	memcpy(buf->carry, p, buf->carry_len);
+
+	return p - buf->data;
+}
+
+/* Offset of the first delimiter among @len bytes at @p, @len for none */
+static size_t delim_find(const struct delim_set *set, const char *p,
+			 size_t len)
+{
+	size_t pos, chunk;
+	u32 mask;
+
+	for (pos = 0; pos < len; pos += chunk) {
+		mask = delim_scan_chunk(set, p + pos, len - pos, &chunk);
+		if (mask)
+			return pos + __ffs(mask);
+	}
+
+	return len;
+}
+
+/*
+ * Whether a message of @len bytes goes to shmem. Only plain phrases do,
+ * as they are all that can be reversed a page at a time.
+ */
+static bool buffer_spills(const struct buffer *buf, size_t len)
+{
+	unsigned long threshold = READ_ONCE(spill_threshold);
+
+	return threshold && len > threshold &&
+	    buf->framing == REVERSE_FRAME_NONE &&
+	    buf->delims.utf8 == REVERSE_UTF8_NONE &&
+	    !(buf->mode & (REVERSE_MODE_LAZY | REVERSE_MODE_APPEND));
+}
+
+/* Start an empty phrase for the append mode. Called by the producer. */
+static int buffer_start_append(struct buffer *buf)
+{
+	if (buf->framing != REVERSE_FRAME_NONE ||
+	    buf->delims.utf8 == REVERSE_UTF8_GRAPHEME)
+		return -EINVAL;
+
+	if (!buf->heap) {
+		buf->heap = kvmalloc_node(buf->size, GFP_KERNEL, buf->node);
+		if (unlikely(!buf->heap))
+			return -ENOMEM;
+	}
+
+	buffer_unspill(buf);
+	buf->data = buf->end = buf->heap + buf->size;
+	buf->lazy = false;
+	buf->has_crc = false;
+	buf->append_tail = 0;
+
+	return 0;
+}
+
+/*
+ * Append @len bytes of user data to the phrase in append mode. The new
+ * words go in front of the output, except that the leading part of the
+ * data may finish the last word of the phrase so far, which sits at the
+ * very front of the output; that word is the only old data touched.
+ * Nothing changes if this fails.
+ */
+static int buffer_append(struct buffer *buf, const char __user *in,
+			 size_t len)
+{
+	const struct delim_set *set = &buf->delims;
+	char *front = buf->data - len;
+	size_t head, tail = buf->append_tail, i;
+
+	if (len > buf->data - buf->heap)
+		return -EFBIG;
+
+	if (copy_from_user(front, in, len))
+		return -EFAULT;
+	if (set->utf8 != REVERSE_UTF8_NONE && !utf8_valid(front, len))
+		return -EILSEQ;
+
+	/*
+	 * [head][rest][tail][old output] becomes [rest reversed][tail][head]
+	 * [old output]: rotate the first three by three reversals, then
+	 * reverse the words of the rest.
+	 */
+	head = delim_find(set, front, len);
+
+	/* The last word of the data is the new unfinished one */
+	for (i = 0; head < len && !delim_test(set, front[len - 1 - i]); i++)
+		;
+
+	if (head && (len > head || tail)) {
+		reverse_word(front, front + head - 1);
+		reverse_word(front + head, front + len + tail - 1);
+		reverse_word(front, front + len + tail - 1);
+	}
+	if (len > head)
+		reverse_phrase(front, front + len - head - 1, set);
+
+	buf->append_tail = head == len ? tail + len : i;
+	buf->data = front;
+	return 0;
+}
+
+/*
+ * Background reversal. Jobs wait in one queue per priority class, ordered
+ * by deadline, and a pool of workers always picks the first job of the
+ * most urgent class. A bulk job gives its worker back after a bulk_slice
+ * worth of work and goes back in line, so interactive jobs submitted
+ * meanwhile don't wait for the whole bulk message to be done.
+ */
+#define REVERSE_STEP_BYTES	16384
+
+/*
+ * Every NUMA node has its own queues and its own workers, which run on the
+ * CPUs of that node: a job is queued on the node its buffer lives on.
+ */
+struct sched_worker {
+	struct work_struct work;
+	struct sched_node *sn;
+};
+
+struct sched_node {
+	spinlock_t lock;
+	struct list_head queues[REVERSE_PRIO_BULK + 1];
+	unsigned int queued;
+	int node;
+	unsigned int nr_workers;
+	struct sched_worker workers[];
+};
+
+static struct workqueue_struct *reverse_wq;
+static struct sched_node **sched_nodes;
+
+static void sched_enqueue(struct reverse_job *job)
+{
+	struct sched_node *sn = sched_nodes[job->node];
+	struct list_head *queue = &sn->queues[job->prio];
+	struct reverse_job *pos;
+	unsigned long flags;
+	unsigned int i, n;
+
+	/* reverse_submit() may be called from interrupts */
+	spin_lock_irqsave(&sn->lock, flags);
+
+	/* Earliest deadline first, first come first served among equals */
+	list_for_each_entry_reverse(pos, queue, list)
+		if (pos->deadline <= job->deadline)
+			break;
+	list_add(&job->list, &pos->list);
+	n = min(++sn->queued, sn->nr_workers);
+
+	spin_unlock_irqrestore(&sn->lock, flags);
+
+	/* A no-op for the workers that are already queued */
+	for (i = 0; i < n; i++)
+		queue_work_node(sn->node, reverse_wq, &sn->workers[i].work);
+}
+
+static struct reverse_job *sched_pick(struct sched_node *sn)
+{
+	struct reverse_job *job = NULL;
+	unsigned int prio;
+
+	spin_lock_irq(&sn->lock);
+	for (prio = REVERSE_PRIO_INTERACTIVE; prio <= REVERSE_PRIO_BULK; prio++) {
+		job = list_first_entry_or_null(&sn->queues[prio],
+					       struct reverse_job, list);
+		if (job) {
+			list_del(&job->list);
+			sn->queued--;
+			break;
+		}
+	}
+	spin_unlock_irq(&sn->lock);
+
+	return job;
+}
+
+/* Queue @job up, prio, len and the rest have to be set already */
+static void reverse_job_submit(struct reverse_job *job, u32 deadline)
+{
+	job->deadline = deadline ?
+	    ktime_get_ns() + (u64)deadline * NSEC_PER_USEC : U64_MAX;
+	job->sliced = job->data && job->prio == REVERSE_PRIO_BULK &&
+	    job->set->utf8 != REVERSE_UTF8_GRAPHEME &&
+	    job->len > REVERSE_STEP_BYTES;
+	job->started = false;
+	job->entry = NULL;
+	memset(&job->state, 0, sizeof(job->state));
+	job->state.crc = job->crc;
+
+	reverse_stat_inc(STAT_ASYNC_JOBS);
+	sched_enqueue(job);
+}
+
+static void reverse_job_done(struct reverse_job *job, ssize_t result)
+{
+	if (ktime_get_ns() > job->deadline)
+		reverse_stat_inc(STAT_DEADLINE_MISSES);
+
+	job->finish(job, result);
+}
+
+/* The reverse_record() part of a sliced job, false if it is done already */
+static bool reverse_job_start(struct reverse_job *job)
+{
+	const struct delim_set *set = job->set;
+	u64 hash;
+
+	job->started = true;
+	job->start_time = ktime_get_ns();
+
+	if (set->utf8 != REVERSE_UTF8_NONE && !utf8_valid(job->data, job->len)) {
+		reverse_job_done(job, -EILSEQ);
+		return false;
+	}
+
+	if (!READ_ONCE(cache_size))
+		return true;
+
+	hash = xxh64(job->data, job->len, set->key);
+	if (cache_lookup(job->data, job->len, hash, set)) {
+		if (job->crc)
+			*job->crc = crc32c(*job->crc, job->data, job->len);
+		reverse_job_done(job, job->len);
+		return false;
+	}
+
+	job->entry = cache_entry_alloc(job->data, job->len, hash, set);
+	return true;
+}
+
+static void reverse_job_run(struct reverse_job *job)
+{
+	u64 slice_end;
+
+	if (!job->sliced) {
+		job->start_time = ktime_get_ns();
+		reverse_job_done(job, job->reverse(job));
+		return;
+	}
+
+	if (!job->started && !reverse_job_start(job))
+		return;
+
+	slice_end = local_clock() + (u64)READ_ONCE(bulk_slice) * NSEC_PER_USEC;
+	do {
+		if (reverse_phrase_step(job->data, job->len, job->set,
+					&job->state, REVERSE_STEP_BYTES)) {
+			if (job->entry)
+				cache_insert(job->entry, job->data, job->set);
+			reverse_job_done(job, job->len);
+			return;
+		}
+	} while (local_clock() < slice_end);
+
+	/* Let anything more urgent that has come along go first */
+	reverse_stat_inc(STAT_BULK_SLICES);
+	sched_enqueue(job);
+}
+
+static void reverse_worker(struct work_struct *work)
+{
+	struct sched_worker *worker = container_of(work, struct sched_worker,
+						   work);
+	struct reverse_job *job;
+
+	while ((job = sched_pick(worker->sn)) != NULL) {
+		reverse_job_run(job);
+		cond_resched();
+	}
+}
+
+static void reverse_sched_free(void)
+{
+	int node;
+
+	for_each_node(node)
+		kfree(sched_nodes[node]);
+	kfree(sched_nodes);
+}
+
+static int reverse_sched_init(void)
+{
+	struct sched_node *sn;
+	unsigned int i, n;
+	int node;
+
+	sched_nodes = kcalloc(nr_node_ids, sizeof(*sched_nodes), GFP_KERNEL);
+	if (!sched_nodes)
+		return -ENOMEM;
+
+	for_each_node(node) {
+		/* One worker per CPU, and one for nodes without any */
+		n = max(nr_cpus_node(node), 1U);
+		sn = kzalloc_node(struct_size(sn, workers, n), GFP_KERNEL, node);
+		if (!sn)
+			goto out;
+
+		spin_lock_init(&sn->lock);
+		for (i = 0; i < ARRAY_SIZE(sn->queues); i++)
+			INIT_LIST_HEAD(&sn->queues[i]);
+		sn->node = node;
+		sn->nr_workers = n;
+		for (i = 0; i < sn->nr_workers; i++) {
+			INIT_WORK(&sn->workers[i].work, reverse_worker);
+			sn->workers[i].sn = sn;
+		}
+
+		sched_nodes[node] = sn;
+	}
+
+	reverse_wq = alloc_workqueue("reverse", WQ_UNBOUND, 0);
+	if (!reverse_wq)
+		goto out;
+
+	return 0;
+
+ out:
+	reverse_sched_free();
+	return -ENOMEM;
+}
+
+static void reverse_sched_exit(void)
+{
+	/* Every job holds an open file, so there are none left by now */
+	destroy_workqueue(reverse_wq);
+	reverse_sched_free();
+}
+
+/*
+ * In-kernel API: other modules can have their data reversed in place
+ * without going through a file, synchronously or by the background
+ * workers. The data must stay put until the call returns or the request
+ * is completed.
+ */
+static int reverse_kernel_set(struct delim_set *set,
+			      const struct reverse_delims *delims)
+{
+	if (!delims) {
+		*set = default_delims;
+		return 0;
+	}
+
+	return delim_set_init(set, delims, REVERSE_UTF8_NONE);
+}
+
+static int reverse_sg_set(struct scatterlist *sgl, unsigned int nents,
+			  size_t len, const struct delim_set *set)
+{
+	struct sg_span ss;
+	int err;
+
+	if (!len)
+		return 0;
+
+	err = sg_span_init(&ss, sgl, nents, len);
+	if (err)
+		return err;
+
+	err = span_reverse_phrase(&ss.span, set);
+
+	kvfree(ss.segs);
+	return err;
+}
+
+int reverse_buffer(char *data, size_t len, const struct reverse_delims *delims)
+{
+	struct delim_set set;
+	int err;
+
+	err = reverse_kernel_set(&set, delims);
+	if (err)
+		return err;
+
+	reverse_message(data, len, &set);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(reverse_buffer);
+
+int reverse_sg(struct scatterlist *sgl, unsigned int nents, size_t len,
+	       const struct reverse_delims *delims)
+{
+	struct delim_set set;
+	int err;
+
+	err = reverse_kernel_set(&set, delims);
+	if (err)
+		return err;
+
+	return reverse_sg_set(sgl, nents, len, &set);
+}
+EXPORT_SYMBOL_GPL(reverse_sg);
+
+struct reverse_kernel_job {
+	struct reverse_job job;
+	struct reverse_request *req;
+	struct delim_set set;
+};
+
+static ssize_t reverse_kernel_reverse(struct reverse_job *job)
+{
+	struct reverse_kernel_job *kjob =
+	    container_of(job, struct reverse_kernel_job, job);
+	struct reverse_request *req = kjob->req;
+
+	if (req->sg)
+		return reverse_sg_set(req->sg, req->nents, req->len, job->set);
+
+	reverse_message(req->data, req->len, job->set);
+	return 0;
+}
+
+static void reverse_kernel_finish(struct reverse_job *job, ssize_t result)
+{
+	struct reverse_kernel_job *kjob =
+	    container_of(job, struct reverse_kernel_job, job);
+	struct reverse_request *req = kjob->req;
+
+	kfree(kjob);
+	req->complete(req, result < 0 ? result : 0);
+}
+
+int reverse_submit(struct reverse_request *req, gfp_t gfp)
+{
+	struct reverse_kernel_job *kjob;
+	int err;
+
+	if (!req->complete || !req->data == !req->sg ||
+	    req->sched.prio == REVERSE_PRIO_SYNC ||
+	    req->sched.prio > REVERSE_PRIO_BULK)
+		return -EINVAL;
+
+	kjob = kzalloc(sizeof(*kjob), gfp);
+	if (!kjob)
+		return -ENOMEM;
+
+	err = reverse_kernel_set(&kjob->set, req->delims);
+	if (err) {
+		kfree(kjob);
+		return err;
+	}
+
+	kjob->req = req;
+	kjob->job.data = req->data;
+	kjob->job.len = req->len;
+	kjob->job.set = &kjob->set;
+	kjob->job.reverse = reverse_kernel_reverse;
+	kjob->job.finish = reverse_kernel_finish;
+	kjob->job.prio = req->sched.prio;
+	kjob->job.node = numa_node_id();
+
+	reverse_job_submit(&kjob->job, req->sched.deadline);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(reverse_submit);
+
+static ssize_t buffer_job_reverse(struct reverse_job *job)
+{
+	struct buffer *buf = container_of(job, struct buffer, job);
+
+	if (buf->spill_len)
+		return buffer_spill_reverse(buf);
+
+	return reverse_frames(buf, job->len);
+}
+
+/* Publish the result, like reverse_write() does for synchronous writes */
+static void buffer_job_finish(struct reverse_job *job, ssize_t result)
+{
+	struct buffer *buf = container_of(job, struct buffer, job);
+	struct file *file = buf->job_file;
+
+	if (result < 0) {
+		buf->error = result;
+		buf->carry_len = 0;
+		buf->end = buf->data;
+		buffer_unspill(buf);
+	} else if (!buf->spill_len) {
+		buf->end = buf->data + result;
+	}
+	buf->has_crc = result >= 0 && (buf->mode & REVERSE_MODE_CRC);
+
+	/* reverse_write() has left the write stamp, if any */
+	buffer_stamp(buf, buf->stamp_write,
+		     buf->stamp_write ? job->start_time : 0);
+
+	/* The next write may reuse the job as soon as this is done */
+	buffer_publish(buf, buf->job_seq);
+	fput(file);
+}
+
+static void buffer_submit(struct buffer *buf, struct file *file,
+			  unsigned long seq, size_t len)
+{
+	struct reverse_job *job = &buf->job;
+
+	buf->job_file = get_file(file);
+	buf->job_seq = seq;
+
+	/* Framed messages are several phrases, they don't get sliced */
+	job->data = buf->framing == REVERSE_FRAME_NONE && !buf->spill_len ?
+	    buf->data : NULL;
+	job->len = len;
+	job->set = &buf->delims;
+	job->reverse = buffer_job_reverse;
+	job->finish = buffer_job_finish;
+	job->prio = buf->sched.prio;
+	job->node = buf->node;
+	job->crc = buf->mode & REVERSE_MODE_CRC ? &buf->crc : NULL;
+
+	reverse_job_submit(job, buf->sched.deadline);
+}
+
+static int reverse_open(struct inode *inode, struct file *file)
+{
+	struct buffer *buf;
+	unsigned long size;
+	int err = 0;
+
+	/*
+	 * Real code can use inode to get pointer to the private
+	 * device state.
+	 */
+
+	/* Admins may have moved the limits since buffer_size was set */
+	size = max(READ_ONCE(buffer_size), READ_ONCE(buffer_size_min));
+	size = max(min(size, READ_ONCE(buffer_size_max)), 1UL);
+
+	buf = buffer_alloc(size);
+	if (unlikely(!buf)) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	file->private_data = buf;
+
+ out:
+	return err;
+}
+
+/* Wait until no message is being written, for the seekable mode */
+static int buffer_stable_seq(struct buffer *buf, bool nonblock,
+			     unsigned long *seq)
+{
+	for (;;) {
+		*seq = smp_load_acquire(&buf->seq);
+		if (!(*seq & 1))
+			return 0;
+		if (nonblock)
+			return -EAGAIN;
+		if (wait_event_interruptible(buf->read_queue,
+					     !(READ_ONCE(buf->seq) & 1)))
+			return -ERESTARTSYS;
+	}
+}
+
+/* The stamps of the current message, see REVERSE_MODE_STAMPS */
+static int buffer_get_stamps(struct buffer *buf, bool nonblock,
+			     struct reverse_stamps *stamps)
+{
+	unsigned long seq;
+	int err;
+
+	do {
+		err = buffer_stable_seq(buf, nonblock, &seq);
+		if (err)
+			return err;
+		stamps->write = READ_ONCE(buf->stamp_write);
+		stamps->reverse_start = READ_ONCE(buf->stamp_start);
+		stamps->reverse_end = READ_ONCE(buf->stamp_end);
+		smp_rmb();
+	} while (READ_ONCE(buf->seq) != seq);
+
+	if (!stamps->write)
+		return -ENODATA;
+
+	spin_lock(&buf->stamp_lock);
+	stamps->first_read = buf->stamp_read_seq == seq ? buf->stamp_read : 0;
+	spin_unlock(&buf->stamp_lock);
+
+	return 0;
+}
+
+/* The CRC32C of the current result, see REVERSE_MODE_CRC */
+static int buffer_get_crc(struct buffer *buf, bool nonblock, u32 *crc)
+{
+	unsigned long seq;
+	bool has_crc;
+	int err;
+
+	do {
+		err = buffer_stable_seq(buf, nonblock, &seq);
+		if (err)
+			return err;
+		has_crc = READ_ONCE(buf->has_crc);
+		*crc = ~READ_ONCE(buf->crc);
+		smp_rmb();
+	} while (READ_ONCE(buf->seq) != seq);
+
+	return has_crc ? 0 : -ENODATA;
+}
+
+/*
+ * A read in the seekable mode: the current message is a file, and @off is
+ * where to read it from. Doesn't touch the consumer state.
+ */
+static ssize_t reverse_read_at(struct buffer *buf, char __user *out,
+			       size_t size, loff_t *off, bool nonblock)
+{
+	struct buffer_view view;
+	unsigned long seq;
+	ssize_t result;
+	int err;
+
+	if (*off < 0)
+		return -EINVAL;
+
+	for (;;) {
+		result = buffer_stable_seq(buf, nonblock, &seq);
+		if (result)
+			return result;
+
+		down_read(&buf->heap_sem);
+		result = 0;
+		err = buffer_view(buf, seq, &view);
+		if (!err && *off < view.len) {
+			result = min_t(size_t, size, view.len - *off);
+			err = buffer_copy_to_user(buf, out, &view, *off, result);
+		}
+		up_read(&buf->heap_sem);
+
+		if (err && err != -EAGAIN)
+			return err;
+
+		/* Retry if the message has been replaced under us */
+		smp_rmb();
+		if (likely(!err && READ_ONCE(buf->seq) == seq))
+			break;
+	}
+
+	if (result > 0) {
+		*off += result;
+		if (unlikely(READ_ONCE(buf->mode) & REVERSE_MODE_STAMPS))
+			buffer_stamp_read(buf, seq);
+	}
+
+	return result;
+}
+
+static ssize_t reverse_read(struct file *file, char __user * out,
+			    size_t size, loff_t * off)
+{
+	struct buffer *buf = file->private_data;
+	struct buffer_view view;
+	unsigned long seq;
+	unsigned int usecs;
+	size_t len;
+	ssize_t result;
+
+	if (READ_ONCE(buf->mode) & REVERSE_MODE_SEEKABLE)
+		return reverse_read_at(buf, out, size, off,
+				       file->f_flags & O_NONBLOCK);
+
+	result = buffer_consume(buf);
+	if (result)
+		goto out;
+
+	buffer_note_access(buf, &buf->read_vote);
+
+	for (;;) {
+		seq = smp_load_acquire(&buf->seq);
+
+		/* A new message has been published, start it over */
+		if (seq != buf->read_seq && !(seq & 1)) {
+			buf->read_seq = seq;
+			buf->read_pos = 0;
+		}
+
+		if (seq == buf->read_seq && !buffer_view(buf, seq, &view) &&
+		    buf->read_pos < view.len) {
+			len = min(size, view.len - buf->read_pos);
+			if (unlikely(view.spilled))
+				down_read(&buf->heap_sem);
+			result = buffer_copy_to_user(buf, out, &view,
+						     buf->read_pos, len);
+			if (unlikely(view.spilled))
+				up_read(&buf->heap_sem);
+			if (result && result != -EAGAIN)
+				goto out_release;
+
+			/* Make sure the producer didn't overwrite what we copied */
+			smp_rmb();
+			if (likely(!result && READ_ONCE(buf->seq) == seq))
+				break;
+
+			continue;
+		}
+
+		buffer_release_consumer(buf);
+		if (file->f_flags & O_NONBLOCK) {
+			result = -EAGAIN;
+			goto out;
+		}
+		usecs = READ_ONCE(buf->busy_poll);
+		if (usecs && buffer_busy_poll(buf, usecs)) {
+			reverse_stat_inc(STAT_READ_SPINS);
+		} else if (!buffer_readable(buf)) {
+			/* Only count the reads that really go to sleep */
+			reverse_stat_inc(STAT_READ_SLEEPS);
+			if (wait_event_interruptible
+			    (buf->read_queue, buffer_readable(buf))) {
+				result = -ERESTARTSYS;
+				goto out;
+			}
+		}
+		result = buffer_consume(buf);
+		if (result)
+			goto out;
+	}
+
+	if (unlikely(READ_ONCE(buf->mode) & REVERSE_MODE_STAMPS))
+		buffer_stamp_read(buf, seq);
+
+	buf->read_pos += len;
+	result = len;
+
+ out_release:
+	buffer_release_consumer(buf);
+ out:
+	return result;
+}
+
+static ssize_t reverse_write(struct file *file, const char __user * in,
+			     size_t size, loff_t * off)
+{
+	struct buffer *buf = file->private_data;
+	unsigned long seq;
+	size_t total;
+	ssize_t result;
+	u64 write, start = 0;
+	bool spill, crc = false;
+
+	/* Waiting for the fd counts as time in the queue */
+	write = READ_ONCE(buf->mode) & REVERSE_MODE_STAMPS ? ktime_get_ns() : 0;
+
+	if (size > READ_ONCE(buf->size) && !READ_ONCE(spill_threshold)) {
+		result = -EFBIG;
+		goto out;
+	}
+
+	result = buffer_produce(buf, &seq);
+	if (result)
+		goto out;
+
+	/* The previous message has failed in the background */
+	if (unlikely(buf->error)) {
+		result = buf->error;
+		buf->error = 0;
+		goto out_yield;
+	}
+
+	total = buf->carry_len + size;
+	spill = buffer_spills(buf, total);
+	if (total > (spill ? READ_ONCE(spill_size_max) : buf->size)) {
+		result = -EFBIG;
+		goto out_yield;
+	}
+
+	buffer_note_access(buf, &buf->write_vote);
+	if (unlikely(READ_ONCE(numa_migrate)))
+		buffer_migrate(buf);
+
+	if (buf->mode & REVERSE_MODE_APPEND) {
+		start = buffer_clock(write);
+		result = buffer_append(buf, in, size);
+		if (result)
+			goto out_yield;
+		result = size;
+		goto out_publish;
+	}
+
+	if (spill) {
+		result = buffer_spill(buf, in, total);
+		if (result)
+			goto out_yield;
+		goto out_reverse;
+	}
+
+	if (total > BUFFER_INLINE_SIZE && !buf->heap) {
+		buf->heap = kvmalloc_node(buf->size, GFP_KERNEL, buf->node);
+		if (unlikely(!buf->heap)) {
+			result = -ENOMEM;
+			goto out_yield;
+		}
+	}
+
+	buffer_unspill(buf);
+	buf->data = total > BUFFER_INLINE_SIZE ? buf->heap : buf->small;
+	buf->lazy = false;
+	memcpy(buf->data, buf->carry, buf->carry_len);
+
+	if (copy_from_user(buf->data + buf->carry_len, in, size)) {
+		result = -EFAULT;
+		goto out_drop;
+	}
+
+	/* Only index the words, the readers reverse what they read */
+	if (buf->mode & REVERSE_MODE_LAZY) {
+		if (buf->delims.utf8 != REVERSE_UTF8_NONE &&
+		    !utf8_valid(buf->data, total)) {
+			result = -EILSEQ;
+			goto out_drop;
+		}
+
+		start = buffer_clock(write);
+		buf->lazy_delims = buf->delims;
+		lazy_index(buf, total);
+		buf->lazy = true;
+		buf->end = buf->data + total;
+		result = size;
+		goto out_publish;
+	}
+
+ out_reverse:
+	buf->crc = ~0U;
+
+	/* The job publishes the message once it is done */
+	if (buf->sched.prio != REVERSE_PRIO_SYNC) {
+		buf->stamp_write = write;
+		buffer_submit(buf, file, seq, total);
+		result = size;
+		goto out;
+	}
+
+	start = buffer_clock(write);
+	if (buf->spill_len) {
+		result = buffer_spill_reverse(buf);
+		if (result)
+			goto out_drop;
+	} else {
+		result = reverse_frames(buf, total);
+		if (result < 0)
+			goto out_drop;
+		buf->end = buf->data + result;
+	}
+	crc = buf->mode & REVERSE_MODE_CRC;
+	result = size;
+ out_publish:
+	buf->has_crc = crc;
+	buffer_stamp(buf, write, start);
+	buffer_publish(buf, seq);
+ out:
+	return result;
+
+ out_drop:
+	/* Don't leave a half-overwritten message behind */
+	buf->carry_len = 0;
+	buf->end = buf->data;
+	buffer_unspill(buf);
+	goto out_publish;
+
+ out_yield:
+	/* Nothing has been touched, the old message is still valid */
+	buffer_yield(buf, seq);
+	return result;
+}
+
+static loff_t reverse_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct buffer *buf = file->private_data;
+	struct buffer_view view;
+	unsigned long seq;
+	int err;
+
+	if (!(READ_ONCE(buf->mode) & REVERSE_MODE_SEEKABLE))
+		return noop_llseek(file, offset, whence);
+
+	do {
+		err = buffer_stable_seq(buf, file->f_flags & O_NONBLOCK, &seq);
+		if (err)
+			return err;
+	} while (buffer_view(buf, seq, &view));
+
+	return fixed_size_llseek(file, offset, whence, view.len);
+}
+
+static long reverse_export_fd(struct buffer *buf,
+			      struct reverse_export __user *uexport)
+{
+	struct reverse_export export;
+	struct file *file;
+	unsigned long seq;
+	size_t len;
+	long result;
+
+	if (copy_from_user(&export, uexport, sizeof(export)))
+		return -EFAULT;
+	if (export.flags & ~O_CLOEXEC)
+		return -EINVAL;
+
+	/* Waits for the message being written, if any */
+	result = buffer_produce(buf, &seq);
+	if (result)
+		return result;
+	file = buffer_export(buf, &len);
+	buffer_yield(buf, seq);
+
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	result = get_unused_fd_flags(export.flags);
+	if (result < 0)
+		goto out_put;
+
+	export.fd = result;
+	export.len = len;
+	if (copy_to_user(uexport, &export, sizeof(export))) {
+		put_unused_fd(export.fd);
+		result = -EFAULT;
+		goto out_put;
+	}
+
+	fd_install(export.fd, file);
+	return 0;
+
+ out_put:
+	fput(file);
+	return result;
+}
+
+static long reverse_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct buffer *buf = file->private_data;
+	void __user *argp = (void __user *)arg;
+	struct reverse_delims delims;
+	struct reverse_region region;
+	struct reverse_sched sched;
+	struct reverse_coalesce coalesce;
+	struct reverse_stamps stamps;
+	struct delim_set set;
+	unsigned long seq;
+	u32 mode, start, crc;
+	u64 size;
+	u32 utf8, framing, usecs;
+	long result;
+
+	switch (cmd) {
+	case REVERSE_IOC_SET_DELIMS:
+	case REVERSE_IOC_SET_UTF8:
+		delims = buf->delims.delims;
+		utf8 = buf->delims.utf8;
+
+		if (cmd == REVERSE_IOC_SET_DELIMS)
+			result = copy_from_user(&delims, argp, sizeof(delims));
+		else
+			result = get_user(utf8, (u32 __user *)argp);
+		if (result) {
+			result = -EFAULT;
+			break;
+		}
+
+		result = delim_set_init(&set, &delims, utf8);
+		if (result)
+			break;
+
+		/* Keep writers from reversing with a half-updated set */
+		result = buffer_produce(buf, &seq);
+		if (result)
+			break;
+		if (utf8 == REVERSE_UTF8_GRAPHEME &&
+		    (buf->mode & REVERSE_MODE_APPEND))
+			result = -EINVAL;
+		else
+			buf->delims = set;
+		buffer_yield(buf, seq);
+		break;
+
+	case REVERSE_IOC_GET_DELIMS:
+		delims = buf->delims.delims;
+		result = copy_to_user(argp, &delims, sizeof(delims)) ?
+		    -EFAULT : 0;
+		break;
+
+	case REVERSE_IOC_GET_UTF8:
+		result = put_user(buf->delims.utf8, (u32 __user *)argp);
+		break;
+
+	case REVERSE_IOC_SET_FRAMING:
+		if (get_user(framing, (u32 __user *)argp)) {
+			result = -EFAULT;
+			break;
+		}
+		if (framing > REVERSE_FRAME_LENGTH) {
+			result = -EINVAL;
+			break;
+		}
+
+		result = buffer_produce(buf, &seq);
+		if (result)
+			break;
+
+		/* A lazy or appended message is a single phrase */
+		if (framing != REVERSE_FRAME_NONE &&
+		    (buf->mode & (REVERSE_MODE_LAZY | REVERSE_MODE_APPEND))) {
+			result = -EINVAL;
+			buffer_yield(buf, seq);
+			break;
+		}
+
+		/* Every record would be stuck in the carry buffer for good */
+		if (framing == REVERSE_FRAME_LENGTH && buf->size < sizeof(u32)) {
+			result = -EINVAL;
+			buffer_yield(buf, seq);
+			break;
+		}
+
+		if (framing != REVERSE_FRAME_NONE && !buf->carry) {
+			buf->carry = kvmalloc_node(buf->size, GFP_KERNEL,
+						   buf->node);
+			if (unlikely(!buf->carry)) {
+				result = -ENOMEM;
+				buffer_yield(buf, seq);
+				break;
+			}
+		}
+
+		buf->framing = framing;
+		buf->carry_len = 0;
+		buffer_yield(buf, seq);
+		break;
+
+	case REVERSE_IOC_GET_FRAMING:
+		result = put_user(buf->framing, (u32 __user *)argp);
+		break;
+
+	case REVERSE_IOC_REVERSE_USER:
+		if (copy_from_user(&region, argp, sizeof(region))) {
+			result = -EFAULT;
+			break;
+		}
+
+		/* A private copy, SET_DELIMS may come along meanwhile */
+		set = buf->delims;
+		if (set.utf8 != REVERSE_UTF8_NONE) {
+			result = -EOPNOTSUPP;
+			break;
+		}
+
+		result = reverse_user_region(&set, &region);
+		break;
+
+	case REVERSE_IOC_SET_BUSY_POLL:
+		if (get_user(usecs, (u32 __user *)argp)) {
+			result = -EFAULT;
+			break;
+		}
+
+		if (usecs > BUSY_POLL_MAX) {
+			result = -EINVAL;
+			break;
+		}
+
+		WRITE_ONCE(buf->busy_poll, usecs);
+		result = 0;
+		break;
+
+	case REVERSE_IOC_GET_BUSY_POLL:
+		result = put_user(READ_ONCE(buf->busy_poll), (u32 __user *)argp);
+		break;
+
+	case REVERSE_IOC_SET_SCHED:
+		if (copy_from_user(&sched, argp, sizeof(sched))) {
+			result = -EFAULT;
+			break;
+		}
+		if (sched.prio > REVERSE_PRIO_BULK ||
+		    (sched.prio == REVERSE_PRIO_SYNC && sched.deadline)) {
+			result = -EINVAL;
+			break;
+		}
+
+		/* Waits for the job in flight, if any */
+		result = buffer_produce(buf, &seq);
+		if (result)
+			break;
+		buf->sched = sched;
+		buffer_yield(buf, seq);
+		break;
+
+	case REVERSE_IOC_GET_SCHED:
+		sched = buf->sched;
+		result = copy_to_user(argp, &sched, sizeof(sched)) ?
+		    -EFAULT : 0;
+		break;
+
+	case REVERSE_IOC_SET_SIZE:
+		if (get_user(size, (u64 __user *)argp)) {
+			result = -EFAULT;
+			break;
+		}
+		if (size < READ_ONCE(buffer_size_min) ||
+		    size > READ_ONCE(buffer_size_max)) {
+			result = -EINVAL;
+			break;
+		}
+
+		result = buffer_resize(buf, size);
+		break;
+
+	case REVERSE_IOC_GET_SIZE:
+		result = put_user((u64)READ_ONCE(buf->size), (u64 __user *)argp);
+		break;
+
+	case REVERSE_IOC_SET_MODE:
+		if (get_user(mode, (u32 __user *)argp)) {
+			result = -EFAULT;
+			break;
+		}
+		if (mode & ~(REVERSE_MODE_SEEKABLE | REVERSE_MODE_LAZY |
+			     REVERSE_MODE_APPEND | REVERSE_MODE_STAMPS |
+			     REVERSE_MODE_CRC) ||
+		    hweight32(mode & (REVERSE_MODE_LAZY | REVERSE_MODE_APPEND |
+				      REVERSE_MODE_CRC)) > 1) {
+			result = -EINVAL;
+			break;
+		}
+
+		result = buffer_produce(buf, &seq);
+		if (result)
+			break;
+
+		/* Coalesced wakeups would drop all but the last message */
+		if (!(mode & REVERSE_MODE_APPEND) &&
+		    buf->coalesce_batch > 1) {
+			result = -EINVAL;
+			buffer_yield(buf, seq);
+			break;
+		}
+
+		if (mode & REVERSE_MODE_LAZY) {
+			/* The index holds u32 positions */
+			if (buf->framing != REVERSE_FRAME_NONE ||
+			    buf->size > U32_MAX) {
+				result = -EINVAL;
+				buffer_yield(buf, seq);
+				break;
+			}
+			if (!buf->lazy_next) {
+				buf->lazy_next = lazy_index_alloc(buf->size,
+								  buf->node);
+				if (!buf->lazy_next) {
+					result = -ENOMEM;
+					buffer_yield(buf, seq);
+					break;
+				}
+				buf->lazy_prev = buf->lazy_next +
+				    DIV_ROUND_UP(buf->size, LAZY_BLOCK);
+			}
+		}
+
+		/* Other flags may change without losing the phrase */
+		start = mode & ~buf->mode & REVERSE_MODE_APPEND;
+		if (start) {
+			result = buffer_start_append(buf);
+			if (result) {
+				buffer_yield(buf, seq);
+				break;
+			}
+		}
+
+		WRITE_ONCE(buf->mode, mode);
+
+		/* A new phrase has been started */
+		if (start)
+			buffer_publish(buf, seq);
+		else
+			buffer_yield(buf, seq);
+		break;
+
+	case REVERSE_IOC_GET_MODE:
+		result = put_user(READ_ONCE(buf->mode), (u32 __user *)argp);
+		break;
+
+	case REVERSE_IOC_EXPORT:
+		result = reverse_export_fd(buf, argp);
+		break;
+
+	case REVERSE_IOC_SET_COALESCE:
+		if (copy_from_user(&coalesce, argp, sizeof(coalesce))) {
+			result = -EFAULT;
+			break;
+		}
+		if (coalesce.max_batch > 1 &&
+		    (!coalesce.max_delay || coalesce.max_delay > USEC_PER_SEC)) {
+			result = -EINVAL;
+			break;
+		}
+
+		/* Keeps the two consistent for buffer_publish() */
+		result = buffer_produce(buf, &seq);
+		if (result)
+			break;
+
+		/* Only appended output piles up for the reader to find */
+		if (coalesce.max_batch > 1 &&
+		    !(buf->mode & REVERSE_MODE_APPEND)) {
+			result = -EINVAL;
+			buffer_yield(buf, seq);
+			break;
+		}
+		WRITE_ONCE(buf->coalesce_batch, coalesce.max_batch);
+		WRITE_ONCE(buf->coalesce_delay, coalesce.max_delay);
+		buffer_yield(buf, seq);
+
+		/* Don't keep readers waiting on the old settings */
+		hrtimer_cancel(&buf->coalesce_timer);
+		buffer_coalesce_flush(buf);
+		break;
+
+	case REVERSE_IOC_GET_COALESCE:
+		coalesce.max_batch = READ_ONCE(buf->coalesce_batch);
+		coalesce.max_delay = READ_ONCE(buf->coalesce_delay);
+		result = copy_to_user(argp, &coalesce, sizeof(coalesce)) ?
+		    -EFAULT : 0;
+		break;
+
+	case REVERSE_IOC_GET_STAMPS:
+		result = buffer_get_stamps(buf, file->f_flags & O_NONBLOCK,
+					   &stamps);
+		if (!result && copy_to_user(argp, &stamps, sizeof(stamps)))
+			result = -EFAULT;
+		break;
+
+	case REVERSE_IOC_GET_CRC:
+		result = buffer_get_crc(buf, file->f_flags & O_NONBLOCK, &crc);
+		if (!result)
+			result = put_user(crc, (u32 __user *)argp);
+		break;
+
+	default:
+		result = -ENOTTY;
+	}
+
+	return result;
+}
+
+static int reverse_close(struct inode *inode, struct file *file)
+{
+	struct buffer *buf = file->private_data;
+
+	buffer_free(buf);
+
+	return 0;
+}
+
+static struct file_operations reverse_fops = {
+	.owner = THIS_MODULE,
+	.open = reverse_open,
+	.read = reverse_read,
+	.write = reverse_write,
+	.unlocked_ioctl = reverse_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.release = reverse_close,
+	.llseek = reverse_llseek
+};
+
+static struct miscdevice reverse_misc_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "reverse",
+	.fops = &reverse_fops
+};
+
+struct proc_dir_entry *reverse_proc_dir;
+
+static int reverse_stats_show(struct seq_file *m, void *v)
+{
+	struct reverse_stats sum = { };
+	struct reverse_stats *stats;
+	int cpu, node, i;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(&reverse_stats, cpu);
+		for (i = 0; i < NR_REVERSE_STATS; i++)
+			sum.count[i] += stats->count[i];
+	}
+
+	for (i = 0; i < NR_REVERSE_STATS; i++)
+		seq_printf(m, "%s %llu\n", reverse_stat_names[i], sum.count[i]);
+
+	/* Where the buffers were touched from, split up by node */
+	for_each_online_node(node) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			if (cpu_to_node(cpu) != node)
+				continue;
+			stats = per_cpu_ptr(&reverse_stats, cpu);
+			sum.count[STAT_NUMA_LOCAL] += stats->count[STAT_NUMA_LOCAL];
+			sum.count[STAT_NUMA_REMOTE] +=
+			    stats->count[STAT_NUMA_REMOTE];
+		}
+		seq_printf(m, "node%d numa_local %llu numa_remote %llu\n", node,
+			   sum.count[STAT_NUMA_LOCAL],
+			   sum.count[STAT_NUMA_REMOTE]);
+	}
+	seq_printf(m, "cache_entries %lu\n", READ_ONCE(cache_entries));
+	seq_printf(m, "cache_bytes %zu\n", READ_ONCE(cache_bytes));
+
+	return 0;
+}
+
+static int __init reverse_init(void)
+{
+	int err;
+
+	if (!buffer_size || !buffer_size_min ||
+	    buffer_size < buffer_size_min || buffer_size > buffer_size_max)
+		return -1;
+
+	err = reverse_sched_init();
+	if (err)
+		return err;
+
+	reverse_proc_dir = proc_mkdir("reverse", NULL);
+	if (!reverse_proc_dir) {
+		err = -ENOMEM;
+		goto out_sched;
+	}
+
+	if (!proc_create_single("stats", S_IRUGO, reverse_proc_dir,
+				reverse_stats_show)) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = reverse_bench_init();
+	if (err)
+		goto out;
+
+	err = misc_register(&reverse_misc_device);
+	if (err)
+		goto out;
+
+	err = reverse_bcast_init();
+	if (err)
+		goto out_reverse;
+
+	err = reverse_queue_init();
+	if (err)
+		goto out_bcast;
+
+	err = reverse_genl_init();
+	if (err)
+		goto out_queue;
+
+	printk(KERN_INFO
+	       "reverse device has been registered, buffer size is %lu bytes\n",
+	       buffer_size);
+
+	return 0;
+
+ out_queue:
+	reverse_queue_exit();
+ out_bcast:
+	reverse_bcast_exit();
+ out_reverse:
+	misc_deregister(&reverse_misc_device);
+ out:
+	proc_remove(reverse_proc_dir);
+ out_sched:
+	reverse_sched_exit();
+	return err;
+}
+
+static void __exit reverse_exit(void)
+{
+	reverse_genl_exit();
+	reverse_queue_exit();
+	reverse_bcast_exit();
+	misc_deregister(&reverse_misc_device);
+
+	proc_remove(reverse_proc_dir);
+	reverse_sched_exit();
+	cache_flush();
+
+	printk(KERN_INFO "reverse device has been unregistered\n");
+}
+
+module_init(reverse_init);
+module_exit(reverse_exit);
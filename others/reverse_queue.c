@@ -0,0 +1,177 @@
+#include <linux/kernel.h>	/* container_of() */
+#include <linux/module.h>	/* THIS_MODULE */
+#include <linux/moduleparam.h>	/* module_param() and MODULE_PARM_DESC() */
+
+#include <linux/fs.h>		/* struct file_operations, struct file */
+#include <linux/miscdevice.h>	/* struct miscdevice and misc_[de]register() */
+#include <linux/list.h>		/* the FIFO */
+#include <linux/spinlock.h>	/* queue lock */
+#include <linux/wait.h>		/* exclusive waits */
+#include <linux/slab.h>		/* kvmalloc() function */
+#include <linux/uaccess.h>	/* copy_{to,from}_user() */
+
+#include "reverse_internal.h"	/* the reversal engine */
+
+static unsigned int queue_depth = 1024;
+module_param(queue_depth, uint, (S_IRUSR | S_IRGRP | S_IROTH));
+MODULE_PARM_DESC(queue_depth, "Maximum number of messages in /dev/reverse_queue");
+
+/*
+ * Work distribution mode: /dev/reverse_queue is a single FIFO of reversed
+ * messages shared by all of its users. Every message is handed to exactly
+ * one reader, and readers wait exclusively, so a write wakes up a single
+ * consumer instead of all of them.
+ */
+struct queue_msg {
+	struct list_head list;
+	size_t len;
+	char data[];
+};
+
+static LIST_HEAD(queue_list);
+static unsigned int queue_len;
+static DEFINE_SPINLOCK(queue_lock);
+static DECLARE_WAIT_QUEUE_HEAD(queue_read_queue);
+static DECLARE_WAIT_QUEUE_HEAD(queue_write_queue);
+
+static ssize_t reverse_queue_read(struct file *file, char __user * out,
+				  size_t size, loff_t * off)
+{
+	struct queue_msg *msg;
+	ssize_t result;
+
+	spin_lock(&queue_lock);
+	while (list_empty(&queue_list)) {
+		spin_unlock(&queue_lock);
+		if (file->f_flags & O_NONBLOCK) {
+			result = -EAGAIN;
+			goto out;
+		}
+		if (wait_event_interruptible_exclusive
+		    (queue_read_queue, READ_ONCE(queue_len))) {
+			result = -ERESTARTSYS;
+			goto out;
+		}
+		spin_lock(&queue_lock);
+	}
+
+	msg = list_first_entry(&queue_list, struct queue_msg, list);
+	if (msg->len > size) {
+		spin_unlock(&queue_lock);
+		result = -EMSGSIZE;
+		goto out_pass;
+	}
+
+	list_del(&msg->list);
+	queue_len--;
+	spin_unlock(&queue_lock);
+
+	if (copy_to_user(out, msg->data, msg->len)) {
+		/* Put it back for somebody else */
+		spin_lock(&queue_lock);
+		list_add(&msg->list, &queue_list);
+		queue_len++;
+		spin_unlock(&queue_lock);
+		result = -EFAULT;
+		goto out_pass;
+	}
+
+	result = msg->len;
+	kvfree(msg);
+
+	wake_up_interruptible(&queue_write_queue);
+ out:
+	return result;
+
+ out_pass:
+	/* We were woken for a message we didn't take, pass the wakeup on */
+	wake_up_interruptible(&queue_read_queue);
+	return result;
+}
+
+static ssize_t reverse_queue_write(struct file *file, const char __user * in,
+				   size_t size, loff_t * off)
+{
+	struct queue_msg *msg;
+	ssize_t result;
+
+	if (size > READ_ONCE(buffer_size)) {
+		result = -EFBIG;
+		goto out;
+	}
+
+	msg = kvmalloc(struct_size(msg, data, size), GFP_KERNEL);
+	if (unlikely(!msg)) {
+		result = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(msg->data, in, size)) {
+		result = -EFAULT;
+		goto out_free;
+	}
+
+	msg->len = size;
+	reverse_message(msg->data, size, &default_delims);
+
+	spin_lock(&queue_lock);
+	while (queue_len >= queue_depth) {
+		spin_unlock(&queue_lock);
+		if (file->f_flags & O_NONBLOCK) {
+			result = -EAGAIN;
+			goto out_free;
+		}
+		if (wait_event_interruptible_exclusive
+		    (queue_write_queue, READ_ONCE(queue_len) < queue_depth)) {
+			result = -ERESTARTSYS;
+			goto out_free;
+		}
+		spin_lock(&queue_lock);
+	}
+
+	list_add_tail(&msg->list, &queue_list);
+	queue_len++;
+	spin_unlock(&queue_lock);
+
+	/* Exclusive waiters: this wakes up one consumer only */
+	wake_up_interruptible(&queue_read_queue);
+
+	result = size;
+ out:
+	return result;
+
+ out_free:
+	kvfree(msg);
+	return result;
+}
+
+static struct file_operations reverse_queue_fops = {
+	.owner = THIS_MODULE,
+	.read = reverse_queue_read,
+	.write = reverse_queue_write,
+	.llseek = noop_llseek
+};
+
+static struct miscdevice reverse_queue_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "reverse_queue",
+	.fops = &reverse_queue_fops
+};
+
+int __init reverse_queue_init(void)
+{
+	if (!queue_depth)
+		return -EINVAL;
+
+	return misc_register(&reverse_queue_device);
+}
+
+void reverse_queue_exit(void)
+{
+	struct queue_msg *msg, *tmp;
+
+	misc_deregister(&reverse_queue_device);
+
+	list_for_each_entry_safe(msg, tmp, &queue_list, list)
+		kvfree(msg);
+}
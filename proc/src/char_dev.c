@@ -5,7 +5,10 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/compat.h>
 
 // Prototypes header.
 #include "char_dev.h"
@@ -16,30 +19,35 @@
 #define DEVICE_NAME "char_dev" // Device name as it appears in /proc/devices.
 #define BUF_LEN 80 // Max length of the message FROM the device.
 
-// Global variables are declared as static so they are global within the FILE
-
-// Used to prevent multiple access to the device.
-static int Device_Open = 0;
-
-// The message the device will return when asked.
-static char Message[BUF_LEN];
-static char* Message_Ptr;
+// Every open of the device is a session with its own message, so
+// callers on different files never wait for each other. The lock only
+// serializes callers sharing one file.
+struct session
+{
+	struct mutex lock;
+	// The message the device will return when asked.
+	char message[BUF_LEN + 1];
+	char* message_ptr;
+};
 
 
 
 static int device_open(struct inode* inode, struct file* file)
 {
+	struct session* session;
+
 	printk(KERN_INFO "device_open(%p, %p)\n", inode, file);
-	
-	if (Device_Open)
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
 	{
-		return -EBUSY;
+		return -ENOMEM;
 	}
 
-	Device_Open++;
+	mutex_init(&session->lock);
 	// Initialize the message.
-	Message_Ptr = Message;
-	try_module_get(THIS_MODULE);
+	session->message_ptr = session->message;
+	file->private_data = session;
 
 	return SUCCESS;
 }
@@ -49,125 +57,198 @@ static int device_release(struct inode* inode, struct file* file)
 {
 	printk(KERN_INFO "device_release(%p, %p)\n", inode, file);
 
-	// Ready for our next caller.
-	Device_Open--;
+	kfree(file->private_data);
 
-	module_put(THIS_MODULE);
 	return SUCCESS;
 }
 
 /**
  * @param buffer	User space buffer to be filled with data.
  */
-static ssize_t device_read(struct file* file, char __user* buffer, size_t length, loff_t offset)
+static ssize_t device_read(struct file* file, char __user* buffer, size_t length, loff_t* offset)
 {
+	struct session* session = file->private_data;
 	// Number of bytes actually written to the buffer.
-	int bytes_read = 0;
+	ssize_t bytes_read = 0;
 
-	printk(KERN_INFO "device_read(%p, %p, %d)\n", file, buffer, length);
+	printk(KERN_INFO "device_read(%p, %p, %zu)\n", file, buffer, length);
 
-	// If we're at the end of the message, return 0.
-	if (*Message_Ptr == 0)
+	if (mutex_lock_interruptible(&session->lock))
 	{
-		return 0;
+		return -ERESTARTSYS;
 	}
 
-	// Put the data into the buffer.
-	while( length && *Message_Ptr)
+	// Put the data into the buffer, if we're at the end of the message
+	// this returns 0.
+	while (length && *session->message_ptr)
 	{
 		// Use put_user since the buffer is in user data segement
 		// and not the kernel data segment.
-		put_user(*(Message_Ptr++), buffer++);
+		if (put_user(*session->message_ptr, buffer++))
+		{
+			bytes_read = bytes_read ? bytes_read : -EFAULT;
+			break;
+		}
+		session->message_ptr++;
 		length--;
 		bytes_read++;
 	}
 
+	mutex_unlock(&session->lock);
+
 	// Print more debugging information.
-	printk(KERN_INFO "Read %d bytes, %d left\n", bytes_read, length);
+	printk(KERN_INFO "Read %zd bytes, %zu left\n", bytes_read, length);
 
 	// Read functions normally return the number of bytes inserted
 	// into the buffer.
-	return bytes_read;	
+	return bytes_read;
 }
 
 
 static ssize_t device_write(struct file* file, const char __user* buffer, size_t length, loff_t* offset)
 {
-	int i;
+	struct session* session = file->private_data;
+	char message[BUF_LEN + 1];
 
-	printk(KERN_INFO "device_write(%p, %s, %d)", file, buffer, length);
-	
-	// Get the message from user data segment.
-	for(i = 0; i < length && i < BUF_LEN; i++)
+	printk(KERN_INFO "device_write(%p, %p, %zu)", file, buffer, length);
+
+	// Get the message from user data segment, outside of the lock since
+	// it may fault.
+	length = min_t(size_t, length, BUF_LEN);
+	if (copy_from_user(message, buffer, length))
 	{
-		get_user(Message[i], buffer + i);
+		return -EFAULT;
 	}
+	message[length] = 0;
 
+	if (mutex_lock_interruptible(&session->lock))
+	{
+		return -ERESTARTSYS;
+	}
+
+	memcpy(session->message, message, length + 1);
 	// Set the pointer to point to the message written.
-	Message_Ptr = Message;
+	session->message_ptr = session->message;
+
+	mutex_unlock(&session->lock);
 
 	// Return the number of input characters used.
-	return i;
+	return length;
 }
 
 /**
  * This function is called whenever a process tries to do an Input/Output Control on our device file.
- * We get two extra parameters:
+ * It used to sit in the .ioctl slot and run under the Big Kernel Lock; now it is .unlocked_ioctl
+ * and the session lock taken by device_read() and device_write() is all the locking there is.
  * @param ioctl_num	The number of the ioctl called
  * @param ioctl_param	The parameter given to the ioctl function
  *
- * If the ioctl is write or read/write (meaning that the output is returned to the calling 
+ * If the ioctl is write or read/write (meaning that the output is returned to the calling
  * process), the ioctl call returns the output of this function.
  */
-int device_ioctl(struct inode* inode, struct file* file, unsigned int ioctl_num, unsigned long ioctl_param)
+static long device_ioctl(struct file* file, unsigned int ioctl_num, unsigned long ioctl_param)
 {
-	// Not sure if we can printk here. Will try after
-	//printk(KERN_INFO "device_ioctl(%p, %p, %d, %d)\n", inode, file, ioctl_num, ioctl_param);
-	
-	int i;
-	char* temp;
+	struct session* session = file->private_data;
+	char __user* temp;
+	ssize_t ret;
+	long i;
 	char ch;
 
 	// Switch according to the ioctl called.
-	switch(ioctl_num)
+	switch (ioctl_num)
 	{
 	case IOCTL_SET_MSG:
 
-		temp = (char*)ioctl_param;
+		temp = (char __user*)ioctl_param;
 
 		// Find the length of the message.
-		get_user(ch, temp);
-		for(i = 0; ch && i < BUF_LEN; i++, temp++)
+		for (i = 0; i < BUF_LEN; i++, temp++)
 		{
-			get_user(ch, temp);
+			if (get_user(ch, temp))
+			{
+				return -EFAULT;
+			}
+			if (!ch)
+			{
+				break;
+			}
 		}
 
-		device_write(file, (char*)ioctl_param, i, 0);
-		break;
+		ret = device_write(file, (char __user*)ioctl_param, i, NULL);
+		return ret < 0 ? ret : SUCCESS;
 
 	case IOCTL_GET_MSG:
 		// Give the current message to the calling process.
 		// The parameter we got is a pointer, we need to fill it.
-		i = device_read(file, (char*)ioctl_param, 99, 0);
+		ret = device_read(file, (char __user*)ioctl_param, 99, NULL);
+		if (ret < 0)
+		{
+			return ret;
+		}
 
-		put_user('\0', (char*)ioctl_param + i);
-		break;
-	
-	case IOCTL_NTH_BYTE:
+		if (put_user('\0', (char __user*)ioctl_param + ret))
+		{
+			return -EFAULT;
+		}
+		return SUCCESS;
+
+	case IOCTL_GET_NTH_BYTE:
 		// This ioctl is both input (ioctl_param) and output (the return value
 		// of this function).
-		return Message[ioctl_param];
+		if (ioctl_param >= BUF_LEN)
+		{
+			return -EINVAL;
+		}
+
+		if (mutex_lock_interruptible(&session->lock))
+		{
+			return -ERESTARTSYS;
+		}
+		i = session->message[ioctl_param];
+		mutex_unlock(&session->lock);
+
+		return i;
+	}
+
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+// A char* is 4 bytes for 32-bit processes, and the size is part of
+// the ioctl number, so they send different numbers for the same call.
+#define COMPAT_IOCTL_SET_MSG _IOR(MAJOR_NUM, 0, compat_uptr_t)
+#define COMPAT_IOCTL_GET_MSG _IOR(MAJOR_NUM, 1, compat_uptr_t)
+
+static long device_compat_ioctl(struct file* file, unsigned int ioctl_num, unsigned long ioctl_param)
+{
+	switch (ioctl_num)
+	{
+	case COMPAT_IOCTL_SET_MSG:
+		ioctl_num = IOCTL_SET_MSG;
+		break;
+
+	case COMPAT_IOCTL_GET_MSG:
+		ioctl_num = IOCTL_GET_MSG;
 		break;
+
+	case IOCTL_GET_NTH_BYTE:
+		// A plain number, not a pointer.
+		return device_ioctl(file, ioctl_num, ioctl_param);
 	}
 
-	return SUCCESS;
+	return device_ioctl(file, ioctl_num, (unsigned long)compat_ptr(ioctl_param));
 }
+#endif
 
 
 static struct file_operations fops = {
+	.owner = THIS_MODULE,
 	.read = device_read,
 	.write = device_write,
-	.ioctl = device_ioctl,
+	.unlocked_ioctl = device_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = device_compat_ioctl,
+#endif
 	.open = device_open,
 	.release = device_release // close
 };
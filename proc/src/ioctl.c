@@ -73,7 +73,7 @@ ioctl_nth_byte(int file_desc)
 
 	do
 	{
-		c = ioctl(file_desc, IOCTL_NTH_BYTE, i++);
+		c = ioctl(file_desc, IOCTL_GET_NTH_BYTE, i++);
 
 		if(c < 0)
 		{